@@ -0,0 +1,173 @@
+/***************************************************************************
+ *   Copyright © 2022 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   Part of the XcbWindowCapture                                          *
+ *   https://github.com/AndreyBarmaley/xcb-window-capture                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+// full frame capture of the same region on the running display, the two shm paths:
+// xcb_shm_get_image into the segment, and xcb_copy_area into the shared pixmap
+// usage: CaptureBench [milliseconds per path] [window id, root by default] [WxH+X+Y]
+
+#include <QRect>
+#include <QString>
+#include <QRegExp>
+
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <exception>
+
+#include "xcbwrapper.h"
+
+struct PathResult
+{
+    std::vector<double> times;
+    uint64_t requests = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t bytesRead = 0;
+};
+
+bool capturePath(XcbConnection & xcb, xcb_drawable_t drawable, const QRect & region, bool copyArea, int ms, PathResult & res)
+{
+    if(copyArea && ! xcb.copyAreaStart(drawable))
+    {
+        std::printf("copy area: no shared pixmaps on this server\n");
+        return false;
+    }
+
+    auto capture = [&]()
+    {
+        QString err;
+        auto pixmap = xcb.completeWindowRegion(xcb.requestWindowRegion(drawable, region, & err), & err);
+
+        if(! pixmap)
+            std::fprintf(stderr, "capture failed: %s\n", err.toStdString().c_str());
+
+        return pixmap != nullptr;
+    };
+
+    // warm up: shm slots, the shared pixmaps and their gc
+    bool ok = true;
+
+    for(int it = 0; ok && it < 3; ++it)
+        ok = capture();
+
+    xcb.statsStart();
+
+    auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+
+    while(ok && std::chrono::steady_clock::now() < limit)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        if(! (ok = capture()))
+            break;
+
+        std::chrono::duration<double, std::micro> dt = std::chrono::steady_clock::now() - start;
+        res.times.push_back(dt.count());
+
+        auto stats = xcb.statsTake();
+        res.bytesWritten += stats.bytesWritten;
+        res.bytesRead += stats.bytesRead;
+    }
+
+    // from the sequence numbers: the requests no call site counts included
+    res.requests = xcb.statsSent();
+
+    // always stopped: a copy area left active would run the next get image pass
+    xcb.statsStop();
+    xcb.copyAreaStop();
+
+    return ok && ! res.times.empty();
+}
+
+void printResult(const char* name, PathResult & res, const QRect & region)
+{
+    std::sort(res.times.begin(), res.times.end());
+
+    const size_t frames = res.times.size();
+    double sum = 0;
+
+    for(auto & val : res.times)
+        sum += val;
+
+    double avg = sum / frames;
+    double mpix = region.width() * region.height() / 1000000.0;
+
+    std::printf("%-10s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %8.1f %10.0f %10.0f\n", name, frames, avg,
+                    res.times.front(), res.times[frames / 2], res.times[frames * 95 / 100], 1000000.0 / avg * mpix,
+                    double(res.requests) / frames, double(res.bytesWritten) / frames, double(res.bytesRead) / frames);
+}
+
+int main(int argc, char** argv)
+{
+    const int ms = 1 < argc ? std::atoi(argv[1]) : 3000;
+
+    try
+    {
+        XcbConnection xcb;
+
+        xcb_window_t win = 2 < argc ? std::strtoul(argv[2], nullptr, 0) : xcb.getScreenRoot();
+        QRect region(QPoint(0, 0), win == xcb.getScreenRoot() ? xcb.getScreenSize() : xcb.getWindowSize(win));
+
+        if(3 < argc)
+        {
+            QRegExp rx("(\\d+)x(\\d+)\\+(\\d+)\\+(\\d+)");
+
+            if(! rx.exactMatch(argv[3]))
+            {
+                std::fprintf(stderr, "region format: WxH+X+Y\n");
+                return EXIT_FAILURE;
+            }
+
+            region = QRect(rx.cap(3).toInt(), rx.cap(4).toInt(), rx.cap(1).toInt(), rx.cap(2).toInt());
+        }
+
+        if(! xcb.getShmExtension())
+        {
+            std::fprintf(stderr, "shm extension not found\n");
+            return EXIT_FAILURE;
+        }
+
+        std::printf("window: 0x%08x, region: %dx%d+%d+%d, full frames\n", win, region.width(), region.height(), region.x(), region.y());
+        std::printf("%-10s %8s %10s %10s %10s %10s %10s %8s %10s %10s\n", "path", "frames", "avg us", "min us", "p50 us", "p95 us", "Mpix/s", "req", "sent B", "recv B");
+
+        // alternated twice: the server and the cpu clocks warm up for both alike
+        for(int round = 0; round < 2; ++round)
+        {
+            for(bool copyArea : { false, true })
+            {
+                PathResult res;
+
+                if(capturePath(xcb, win, region, copyArea, ms / 2, res))
+                    printResult(copyArea ? "copy area" : "get image", res, region);
+            }
+        }
+    }
+    catch(const std::exception & err)
+    {
+        std::fprintf(stderr, "%s\n", err.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+/***************************************************************************
+ *   Copyright © 2022 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   Part of the XcbWindowCapture                                          *
+ *   https://github.com/AndreyBarmaley/xcb-window-capture                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+// same size bgrx to yuv420p: the ColorConvert kernels against swscale,
+// then both split in bands over 1 to N threads
+// usage: ConvertBench [milliseconds per case] [max threads]
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+extern "C" {
+#include "libavutil/imgutils.h"
+#include "libswscale/swscale.h"
+}
+
+#include "colorconvert.h"
+
+struct Resolution
+{
+    int width;
+    int height;
+};
+
+template<typename Func>
+double framesPerSecond(Func && func, int ms)
+{
+    // warm up: caches, page faults of the destination
+    func();
+
+    auto start = std::chrono::steady_clock::now();
+    auto limit = start + std::chrono::milliseconds(ms);
+    size_t frames = 0;
+
+    do
+    {
+        func();
+        frames++;
+    }
+    while(std::chrono::steady_clock::now() < limit);
+
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    return frames / dt.count();
+}
+
+int main(int argc, char** argv)
+{
+    const int ms = 1 < argc ? std::atoi(argv[1]) : 1000;
+    const int maxThreads = 2 < argc ? std::atoi(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+    const Resolution resolutions[] = { { 1280, 720 }, { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 } };
+
+#if (__BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__)
+    const AVPixelFormat srcFormat = AV_PIX_FMT_BGR0;
+#else
+    const AVPixelFormat srcFormat = AV_PIX_FMT_0RGB;
+#endif
+
+    std::printf("%-10s %-14s %10s %10s %8s\n", "size", "converter", "fps", "Mpix/s", "speedup");
+
+    for(auto & res : resolutions)
+    {
+        const size_t pitch = res.width * 4;
+        std::vector<uint8_t> src(pitch * res.height);
+        std::mt19937 rng(res.width);
+
+        for(auto & val : src)
+            val = rng();
+
+        uint8_t* planes[4] = { nullptr };
+        int linesize[4] = { 0 };
+
+        if(0 > av_image_alloc(planes, linesize, res.width, res.height, AV_PIX_FMT_YUV420P, 32))
+        {
+            std::fprintf(stderr, "av_image_alloc failed\n");
+            return EXIT_FAILURE;
+        }
+
+        const uint8_t* data[1] = { src.data() };
+        const int lines[1] = { int(pitch) };
+        const double mpix = res.width * res.height / 1000000.0;
+        char size[32];
+        std::snprintf(size, sizeof(size), "%dx%d", res.width, res.height);
+
+        // the encoder context before the dedicated kernel
+        auto ctx = sws_getContext(res.width, res.height, srcFormat, res.width, res.height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+
+        if(! ctx)
+        {
+            std::fprintf(stderr, "sws_getContext failed\n");
+            return EXIT_FAILURE;
+        }
+
+        double base = framesPerSecond([&]{ sws_scale(ctx, data, lines, 0, res.height, planes, linesize); }, ms);
+        std::printf("%-10s %-14s %10.1f %10.1f %8.2f\n", size, "swscale", base, base * mpix, 1.0);
+        sws_freeContext(ctx);
+
+        auto kernels = ColorConvert::supportedKernels();
+
+        for(auto name : kernels)
+        {
+            ColorConvert::selectKernel(name);
+
+            double fps = framesPerSecond([&]{ ColorConvert::bgrxToI420(src.data(), pitch, res.width, res.height, planes, linesize); }, ms);
+            std::printf("%-10s %-14s %10.1f %10.1f %8.2f\n", size, name, fps, fps * mpix, fps / base);
+        }
+
+        // 2:1 output: the swscale filters against the box kernels, both convert in the same pass
+        uint8_t* half[4] = { nullptr };
+        int halfsize[4] = { 0 };
+
+        if(0 > av_image_alloc(half, halfsize, res.width / 2, res.height / 2, AV_PIX_FMT_YUV420P, 32))
+        {
+            std::fprintf(stderr, "av_image_alloc failed\n");
+            return EXIT_FAILURE;
+        }
+
+        const std::pair<int, const char*> filters[] = { { SWS_AREA, "area" }, { SWS_BILINEAR, "bilinear" }, { SWS_POINT, "point" } };
+
+        for(auto & [flags, name] : filters)
+        {
+            auto ctx = sws_getContext(res.width, res.height, srcFormat, res.width / 2, res.height / 2, AV_PIX_FMT_YUV420P, flags, nullptr, nullptr, nullptr);
+
+            if(! ctx)
+            {
+                std::fprintf(stderr, "sws_getContext failed\n");
+                return EXIT_FAILURE;
+            }
+
+            char label[32];
+            double fps = framesPerSecond([&]{ sws_scale(ctx, data, lines, 0, res.height, half, halfsize); }, ms);
+            std::snprintf(label, sizeof(label), "%s 2:1", name);
+            std::printf("%-10s %-14s %10.1f %10.1f %8.2f\n", size, label, fps, fps * mpix, fps / base);
+            sws_freeContext(ctx);
+        }
+
+        for(auto name : kernels)
+        {
+            ColorConvert::selectKernel(name);
+
+            char label[32];
+            double fps = framesPerSecond([&]{ ColorConvert::halfToI420(ColorConvert::PixelLayout::BGRX32, src.data(), pitch, res.width / 2, res.height / 2, half, halfsize); }, ms);
+            std::snprintf(label, sizeof(label), "box %s", name);
+            std::printf("%-10s %-14s %10.1f %10.1f %8.2f\n", size, label, fps, fps * mpix, fps / base);
+        }
+
+        av_freep(& half[0]);
+
+        // bands as in the encoder: the best kernel, or one swscale context each
+        ColorConvert::selectKernel(kernels.front());
+
+        for(int threads = 1; threads <= maxThreads; ++threads)
+        {
+            ColorConvert::SliceWorkers workers(threads);
+            std::vector<SwsContext*> bands;
+
+            for(int band = 0; band < threads; ++band)
+            {
+                int rows = ColorConvert::SliceWorkers::bandRows(res.height, threads, band).second;
+                bands.push_back(sws_getContext(res.width, rows, srcFormat, res.width, rows, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr));
+            }
+
+            auto convertBand = [&](int band, bool kernel)
+            {
+                auto [row, rows] = ColorConvert::SliceWorkers::bandRows(res.height, threads, band);
+
+                const uint8_t* data[1] = { src.data() + row * pitch };
+                uint8_t* dst[3] = { planes[0] + row * linesize[0], planes[1] + (row / 2) * linesize[1], planes[2] + (row / 2) * linesize[2] };
+
+                if(kernel)
+                    ColorConvert::bgrxToI420(data[0], pitch, res.width, rows, dst, linesize);
+                else
+                    sws_scale(bands[band], data, lines, 0, rows, dst, linesize);
+            };
+
+            char label[32];
+            double fps = framesPerSecond([&]{ workers.run([&](int band){ convertBand(band, false); }); }, ms);
+            std::snprintf(label, sizeof(label), "swscale x%d", threads);
+            std::printf("%-10s %-14s %10.1f %10.1f %8.2f\n", size, label, fps, fps * mpix, fps / base);
+
+            fps = framesPerSecond([&]{ workers.run([&](int band){ convertBand(band, true); }); }, ms);
+            std::snprintf(label, sizeof(label), "%s x%d", kernels.front(), threads);
+            std::printf("%-10s %-14s %10.1f %10.1f %8.2f\n", size, label, fps, fps * mpix, fps / base);
+
+            for(auto ctx : bands)
+                sws_freeContext(ctx);
+        }
+
+        av_freep(& planes[0]);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,155 @@
+/***************************************************************************
+ *   Copyright © 2022 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   Part of the XcbWindowCapture                                          *
+ *   https://github.com/AndreyBarmaley/xcb-window-capture                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+// cursor over a 1080p bgrx frame: the CursorBlend kernels against the former
+// QPainter composition, inside the frame and clipped at its edges
+// usage: CursorBench [milliseconds per case]
+
+#include <QImage>
+#include <QPoint>
+#include <QPainter>
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include "cursorblend.h"
+
+struct Placement
+{
+    const char* name;
+    int x;
+    int y;
+};
+
+template<typename Func>
+double microsecondsPerCall(Func && func, int ms)
+{
+    func();
+
+    auto start = std::chrono::steady_clock::now();
+    auto limit = start + std::chrono::milliseconds(ms);
+    size_t calls = 0;
+
+    do
+    {
+        func();
+        calls++;
+    }
+    while(std::chrono::steady_clock::now() < limit);
+
+    std::chrono::duration<double, std::micro> dt = std::chrono::steady_clock::now() - start;
+    return dt.count() / calls;
+}
+
+// premultiplied argb, a cursor shape: a transparent border, an opaque outline, a translucent shadow
+std::vector<uint32_t> makeCursor(int width, int height, std::mt19937 & rng)
+{
+    std::vector<uint32_t> res(width * height, 0);
+
+    for(int row = 2; row < height - 2; ++row)
+    {
+        for(int col = 2; col < std::min(width - 2, row + 2); ++col)
+        {
+            uint32_t alpha = col + 1 == std::min(width - 2, row + 2) ? 0x60 : 0xFF;
+            uint32_t color = rng() & 0xFF;
+            uint32_t premul = color * alpha / 255;
+
+            res[row * width + col] = (alpha << 24) | (premul << 16) | (premul << 8) | premul;
+        }
+    }
+
+    return res;
+}
+
+int main(int argc, char** argv)
+{
+    const int ms = 1 < argc ? std::atoi(argv[1]) : 1000;
+    const int frameWidth = 1920;
+    const int frameHeight = 1080;
+    const size_t pitch = frameWidth * 4;
+
+    std::mt19937 rng(frameWidth);
+    std::vector<uint8_t> frame(pitch * frameHeight);
+
+    for(auto & val : frame)
+        val = rng();
+
+    const std::vector<uint8_t> source = frame;
+
+    std::printf("%-8s %-14s %-10s %10s %8s\n", "cursor", "placement", "blend", "us", "speedup");
+
+    for(int size : { 32, 64 })
+    {
+        auto cursor = makeCursor(size, size, rng);
+
+        const Placement placements[] = {
+            { "inside", frameWidth / 2, frameHeight / 2 },
+            { "left-top", -size / 3, -size / 3 },
+            { "right-bottom", frameWidth - size / 3, frameHeight - size / 3 } };
+
+        for(auto & pos : placements)
+        {
+            char label[32];
+            std::snprintf(label, sizeof(label), "%dx%d", size, size);
+
+            // the composition replaced by CursorBlend: qt wraps both, the painter clips
+            double base = microsecondsPerCall([&]
+            {
+                QImage windowImage(frame.data(), frameWidth, frameHeight, pitch, QImage::Format_RGBX8888);
+                QImage cursorImage(reinterpret_cast<const uint8_t*>(cursor.data()), size, size, QImage::Format_RGBA8888);
+                QPainter painter(& windowImage);
+                painter.drawImage(QPoint(pos.x, pos.y), cursorImage);
+            }, ms);
+
+            std::printf("%-8s %-14s %-10s %10.3f %8.2f\n", label, pos.name, "qpainter", base, 1.0);
+
+            std::vector<uint8_t> reference;
+
+            for(auto name : CursorBlend::supportedKernels())
+            {
+                CursorBlend::selectKernel(name);
+
+                double us = microsecondsPerCall([&]
+                {
+                    CursorBlend::blendBGRX(frame.data(), frameWidth, frameHeight, pitch, cursor.data(), size, size, pos.x, pos.y);
+                }, ms);
+
+                // one blend over the same frame: every kernel gives the same pixels
+                frame = source;
+                CursorBlend::blendBGRX(frame.data(), frameWidth, frameHeight, pitch, cursor.data(), size, size, pos.x, pos.y);
+
+                if(reference.empty())
+                    reference = frame;
+
+                std::printf("%-8s %-14s %-10s %10.3f %8.2f%s\n", label, pos.name, name, us, base / us,
+                                reference == frame ? "" : "  MISMATCH");
+                frame = source;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
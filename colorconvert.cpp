@@ -0,0 +1,865 @@
+/***************************************************************************
+ *   Copyright © 2022 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   Part of the XcbWindowCapture                                          *
+ *   https://github.com/AndreyBarmaley/xcb-window-capture                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLOR_CONVERT_X86
+#endif
+
+#include "colorconvert.h"
+
+namespace ColorConvert
+{
+    // two source rows to two luma rows and one row of each chroma plane
+    typedef void (*RowsFunc)(const uint32_t* src0, const uint32_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width);
+    // one row of two frames, equal or not
+    typedef bool (*EqualFunc)(const uint8_t* a, const uint8_t* b, size_t len);
+    // two source rows to one bgrx row of half width, the 2x2 box average
+    typedef void (*HalveFunc)(const uint8_t* src0, const uint8_t* src1, uint32_t* dst, int width);
+
+    // bt.601 limited range, 8 bit fixed point
+    enum { YR = 66, YG = 129, YB = 25, UR = -38, UG = -74, UB = 112, VR = 112, VG = -94, VB = -18 };
+
+    inline uint8_t lumaScalar(uint32_t p)
+    {
+        int r = (p >> 16) & 0xFF, g = (p >> 8) & 0xFF, b = p & 0xFF;
+        return ((YR * r + YG * g + YB * b + 128) >> 8) + 16;
+    }
+
+    void convertRowsScalar(const uint32_t* src0, const uint32_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+    {
+        for(int it = 0; it + 1 < width; it += 2)
+        {
+            const uint32_t px[4] = { src0[it], src0[it + 1], src1[it], src1[it + 1] };
+            int r = 0, g = 0, b = 0;
+
+            for(auto p : px)
+            {
+                r += (p >> 16) & 0xFF;
+                g += (p >> 8) & 0xFF;
+                b += p & 0xFF;
+            }
+
+            y0[it] = lumaScalar(px[0]);
+            y0[it + 1] = lumaScalar(px[1]);
+            y1[it] = lumaScalar(px[2]);
+            y1[it + 1] = lumaScalar(px[3]);
+
+            // sum of the 2x2 block, scaled by 4 more
+            u[it / 2] = ((UR * r + UG * g + UB * b + 512) >> 10) + 128;
+            v[it / 2] = ((VR * r + VG * g + VB * b + 512) >> 10) + 128;
+        }
+    }
+
+    // packed pixel: storage type, then the shift and the width of each channel
+    template<typename Pixel, int RS, int RW, int GS, int GW, int BS, int BW>
+    struct PackedFormat
+    {
+        typedef Pixel type;
+
+        // to 8 bit: wider channels drop the low bits, narrower ones repeat the high bits
+        template<int Shift, int Width>
+        static inline int channel(Pixel p)
+        {
+            const int val = (p >> Shift) & ((1 << Width) - 1);
+
+            if constexpr(8 <= Width)
+                return val >> (Width - 8);
+            else
+                return (val << (8 - Width)) | (val >> (2 * Width - 8));
+        }
+
+        static inline void rgb(Pixel p, int & r, int & g, int & b)
+        {
+            r = channel<RS, RW>(p);
+            g = channel<GS, GW>(p);
+            b = channel<BS, BW>(p);
+        }
+    };
+
+    typedef PackedFormat<uint32_t, 16, 8, 8, 8, 0, 8> FormatBGRX32;
+    typedef PackedFormat<uint32_t, 0, 8, 8, 8, 16, 8> FormatRGBX32;
+    typedef PackedFormat<uint16_t, 11, 5, 5, 6, 0, 5> FormatRGB565;
+    typedef PackedFormat<uint16_t, 10, 5, 5, 5, 0, 5> FormatRGB555;
+    typedef PackedFormat<uint32_t, 20, 10, 10, 10, 0, 10> FormatRGB30;
+    typedef PackedFormat<uint32_t, 0, 10, 10, 10, 20, 10> FormatBGR30;
+
+    template<typename Format>
+    void convertRowsPacked(const uint8_t* src0, const uint8_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+    {
+        auto px0 = reinterpret_cast<const typename Format::type*>(src0);
+        auto px1 = reinterpret_cast<const typename Format::type*>(src1);
+
+        for(int it = 0; it + 1 < width; it += 2)
+        {
+            int r[4], g[4], b[4];
+
+            Format::rgb(px0[it], r[0], g[0], b[0]);
+            Format::rgb(px0[it + 1], r[1], g[1], b[1]);
+            Format::rgb(px1[it], r[2], g[2], b[2]);
+            Format::rgb(px1[it + 1], r[3], g[3], b[3]);
+
+            y0[it] = ((YR * r[0] + YG * g[0] + YB * b[0] + 128) >> 8) + 16;
+            y0[it + 1] = ((YR * r[1] + YG * g[1] + YB * b[1] + 128) >> 8) + 16;
+            y1[it] = ((YR * r[2] + YG * g[2] + YB * b[2] + 128) >> 8) + 16;
+            y1[it + 1] = ((YR * r[3] + YG * g[3] + YB * b[3] + 128) >> 8) + 16;
+
+            int rs = r[0] + r[1] + r[2] + r[3];
+            int gs = g[0] + g[1] + g[2] + g[3];
+            int bs = b[0] + b[1] + b[2] + b[3];
+
+            u[it / 2] = ((UR * rs + UG * gs + UB * bs + 512) >> 10) + 128;
+            v[it / 2] = ((VR * rs + VG * gs + VB * bs + 512) >> 10) + 128;
+        }
+    }
+
+    template<typename Format>
+    void convertPacked(const uint8_t* src, size_t srcPitch, int width, int height, uint8_t* const planes[3], const int linesize[3])
+    {
+        for(int row = 0; row < height; row += 2)
+        {
+            convertRowsPacked<Format>(src + row * srcPitch, src + (row + 1) * srcPitch,
+                planes[0] + row * linesize[0], planes[0] + (row + 1) * linesize[0],
+                planes[1] + (row / 2) * linesize[1], planes[2] + (row / 2) * linesize[2], width);
+        }
+    }
+
+    // rounded byte average as pavgb, the simd kernels give the same
+    inline int average(int a, int b)
+    {
+        return (a + b + 1) >> 1;
+    }
+
+    // average of the columns averages: pairs of rows first, then pairs of pixels
+    template<typename Format>
+    void halveRowsPacked(const uint8_t* src0, const uint8_t* src1, uint32_t* dst, int width)
+    {
+        auto px0 = reinterpret_cast<const typename Format::type*>(src0);
+        auto px1 = reinterpret_cast<const typename Format::type*>(src1);
+
+        for(int it = 0; it < width; ++it)
+        {
+            int r[4], g[4], b[4];
+
+            Format::rgb(px0[2 * it], r[0], g[0], b[0]);
+            Format::rgb(px1[2 * it], r[1], g[1], b[1]);
+            Format::rgb(px0[2 * it + 1], r[2], g[2], b[2]);
+            Format::rgb(px1[2 * it + 1], r[3], g[3], b[3]);
+
+            dst[it] = (average(average(r[0], r[1]), average(r[2], r[3])) << 16) |
+                        (average(average(g[0], g[1]), average(g[2], g[3])) << 8) |
+                        average(average(b[0], b[1]), average(b[2], b[3]));
+        }
+    }
+
+    template<typename Format>
+    void unpackRGB32(const uint8_t* src, size_t srcPitch, int width, int height, uint32_t* dst, size_t dstPitch)
+    {
+        for(int row = 0; row < height; ++row)
+        {
+            auto px = reinterpret_cast<const typename Format::type*>(src + row * srcPitch);
+            auto out = reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(dst) + row * dstPitch);
+
+            for(int it = 0; it < width; ++it)
+            {
+                int r, g, b;
+                Format::rgb(px[it], r, g, b);
+                out[it] = 0xFF000000 | (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+
+#ifdef COLOR_CONVERT_X86
+    // pixels split in 16 bit pairs per dword: (b, r) and (g, x), then one madd per pair gives the dot product
+    inline constexpr int pair16(int lo, int hi)
+    {
+        return int(uint32_t(hi & 0xFFFF) << 16 | uint32_t(lo & 0xFFFF));
+    }
+
+    __attribute__((target("sse4.1")))
+    inline void splitSSE41(__m128i p, __m128i & br, __m128i & gx)
+    {
+        const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+        br = _mm_and_si128(p, mask);
+        gx = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+    }
+
+    __attribute__((target("sse4.1")))
+    inline __m128i dotSSE41(__m128i br, __m128i gx, int cb, int cg, int cr)
+    {
+        return _mm_add_epi32(_mm_madd_epi16(br, _mm_set1_epi32(pair16(cb, cr))), _mm_madd_epi16(gx, _mm_set1_epi32(pair16(cg, 0))));
+    }
+
+    __attribute__((target("sse4.1")))
+    inline __m128i scaleSSE41(__m128i sum, int round, int shift, int offset)
+    {
+        return _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(round)), shift), _mm_set1_epi32(offset));
+    }
+
+    __attribute__((target("sse4.1")))
+    void convertRowsSSE41(const uint32_t* src0, const uint32_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+    {
+        int it = 0;
+
+        for(; it + 16 <= width; it += 16)
+        {
+            __m128i l0[4], l1[4], cu[4], cv[4];
+
+            for(int k = 0; k < 4; ++k)
+            {
+                __m128i br0, gx0, br1, gx1;
+                splitSSE41(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + it + k * 4)), br0, gx0);
+                splitSSE41(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + it + k * 4)), br1, gx1);
+
+                l0[k] = scaleSSE41(dotSSE41(br0, gx0, YB, YG, YR), 128, 8, 16);
+                l1[k] = scaleSSE41(dotSSE41(br1, gx1, YB, YG, YR), 128, 8, 16);
+
+                // vertical sums per column, at most 510
+                __m128i br = _mm_add_epi16(br0, br1);
+                __m128i gx = _mm_add_epi16(gx0, gx1);
+
+                cu[k] = dotSSE41(br, gx, UB, UG, UR);
+                cv[k] = dotSSE41(br, gx, VB, VG, VR);
+            }
+
+            // all results fit in 0..255, saturation does not clip
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + it), _mm_packus_epi16(_mm_packs_epi32(l0[0], l0[1]), _mm_packs_epi32(l0[2], l0[3])));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + it), _mm_packus_epi16(_mm_packs_epi32(l1[0], l1[1]), _mm_packs_epi32(l1[2], l1[3])));
+
+            // horizontal pairs: the 2x2 block sums, in order
+            __m128i su = _mm_packs_epi32(scaleSSE41(_mm_hadd_epi32(cu[0], cu[1]), 512, 10, 128), scaleSSE41(_mm_hadd_epi32(cu[2], cu[3]), 512, 10, 128));
+            __m128i sv = _mm_packs_epi32(scaleSSE41(_mm_hadd_epi32(cv[0], cv[1]), 512, 10, 128), scaleSSE41(_mm_hadd_epi32(cv[2], cv[3]), 512, 10, 128));
+
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(u + it / 2), _mm_packus_epi16(su, su));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(v + it / 2), _mm_packus_epi16(sv, sv));
+        }
+
+        convertRowsScalar(src0 + it, src1 + it, y0 + it, y1 + it, u + it / 2, v + it / 2, width - it);
+    }
+
+    __attribute__((target("avx2")))
+    inline void splitAVX2(__m256i p, __m256i & br, __m256i & gx)
+    {
+        const __m256i mask = _mm256_set1_epi32(0x00FF00FF);
+        br = _mm256_and_si256(p, mask);
+        gx = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i dotAVX2(__m256i br, __m256i gx, int cb, int cg, int cr)
+    {
+        return _mm256_add_epi32(_mm256_madd_epi16(br, _mm256_set1_epi32(pair16(cb, cr))), _mm256_madd_epi16(gx, _mm256_set1_epi32(pair16(cg, 0))));
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i scaleAVX2(__m256i sum, int round, int shift, int offset)
+    {
+        return _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(round)), shift), _mm256_set1_epi32(offset));
+    }
+
+    // 16 dwords to 16 bytes, packs work per 128 bit lane
+    __attribute__((target("avx2")))
+    inline __m128i packBytesAVX2(__m256i a, __m256i b)
+    {
+        __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        return _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+    }
+
+    __attribute__((target("avx2")))
+    void convertRowsAVX2(const uint32_t* src0, const uint32_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+    {
+        // hadd pairs per lane: chroma 0, 1, 4, 5, 2, 3, 6, 7
+        const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+        int it = 0;
+
+        for(; it + 32 <= width; it += 32)
+        {
+            __m256i l0[4], l1[4], cu[4], cv[4];
+
+            for(int k = 0; k < 4; ++k)
+            {
+                __m256i br0, gx0, br1, gx1;
+                splitAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + it + k * 8)), br0, gx0);
+                splitAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + it + k * 8)), br1, gx1);
+
+                l0[k] = scaleAVX2(dotAVX2(br0, gx0, YB, YG, YR), 128, 8, 16);
+                l1[k] = scaleAVX2(dotAVX2(br1, gx1, YB, YG, YR), 128, 8, 16);
+
+                __m256i br = _mm256_add_epi16(br0, br1);
+                __m256i gx = _mm256_add_epi16(gx0, gx1);
+
+                cu[k] = dotAVX2(br, gx, UB, UG, UR);
+                cv[k] = dotAVX2(br, gx, VB, VG, VR);
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + it), packBytesAVX2(l0[0], l0[1]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + it + 16), packBytesAVX2(l0[2], l0[3]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + it), packBytesAVX2(l1[0], l1[1]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + it + 16), packBytesAVX2(l1[2], l1[3]));
+
+            __m256i u0 = scaleAVX2(_mm256_permutevar8x32_epi32(_mm256_hadd_epi32(cu[0], cu[1]), order), 512, 10, 128);
+            __m256i u1 = scaleAVX2(_mm256_permutevar8x32_epi32(_mm256_hadd_epi32(cu[2], cu[3]), order), 512, 10, 128);
+            __m256i v0 = scaleAVX2(_mm256_permutevar8x32_epi32(_mm256_hadd_epi32(cv[0], cv[1]), order), 512, 10, 128);
+            __m256i v1 = scaleAVX2(_mm256_permutevar8x32_epi32(_mm256_hadd_epi32(cv[2], cv[3]), order), 512, 10, 128);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(u + it / 2), packBytesAVX2(u0, u1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(v + it / 2), packBytesAVX2(v0, v1));
+        }
+
+        convertRowsSSE41(src0 + it, src1 + it, y0 + it, y1 + it, u + it / 2, v + it / 2, width - it);
+    }
+
+    // gcc 12 warns on _mm512_undefined_* inside the intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+    __attribute__((target("avx512f,avx512bw")))
+    inline void splitAVX512(__m512i p, __m512i & br, __m512i & gx)
+    {
+        const __m512i mask = _mm512_set1_epi32(0x00FF00FF);
+        br = _mm512_and_si512(p, mask);
+        gx = _mm512_and_si512(_mm512_srli_epi32(p, 8), mask);
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    inline __m512i dotAVX512(__m512i br, __m512i gx, int cb, int cg, int cr)
+    {
+        return _mm512_add_epi32(_mm512_madd_epi16(br, _mm512_set1_epi32(pair16(cb, cr))), _mm512_madd_epi16(gx, _mm512_set1_epi32(pair16(cg, 0))));
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    inline __m512i scaleAVX512(__m512i sum, int round, int shift, int offset)
+    {
+        return _mm512_add_epi32(_mm512_srai_epi32(_mm512_add_epi32(sum, _mm512_set1_epi32(round)), shift), _mm512_set1_epi32(offset));
+    }
+
+    // no hadd: even and odd columns of two vectors added, in order
+    __attribute__((target("avx512f,avx512bw")))
+    inline __m512i pairsAVX512(__m512i a, __m512i b)
+    {
+        const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+        const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+        return _mm512_add_epi32(_mm512_permutex2var_epi32(a, even, b), _mm512_permutex2var_epi32(a, odd, b));
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    void convertRowsAVX512(const uint32_t* src0, const uint32_t* src1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+    {
+        int it = 0;
+
+        for(; it + 64 <= width; it += 64)
+        {
+            __m512i cu[4], cv[4];
+
+            for(int k = 0; k < 4; ++k)
+            {
+                __m512i br0, gx0, br1, gx1;
+                splitAVX512(_mm512_loadu_si512(src0 + it + k * 16), br0, gx0);
+                splitAVX512(_mm512_loadu_si512(src1 + it + k * 16), br1, gx1);
+
+                // values in 0..255, truncation to bytes is exact
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + it + k * 16), _mm512_cvtepi32_epi8(scaleAVX512(dotAVX512(br0, gx0, YB, YG, YR), 128, 8, 16)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + it + k * 16), _mm512_cvtepi32_epi8(scaleAVX512(dotAVX512(br1, gx1, YB, YG, YR), 128, 8, 16)));
+
+                __m512i br = _mm512_add_epi16(br0, br1);
+                __m512i gx = _mm512_add_epi16(gx0, gx1);
+
+                cu[k] = dotAVX512(br, gx, UB, UG, UR);
+                cv[k] = dotAVX512(br, gx, VB, VG, VR);
+            }
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(u + it / 2), _mm512_cvtepi32_epi8(scaleAVX512(pairsAVX512(cu[0], cu[1]), 512, 10, 128)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(u + it / 2 + 16), _mm512_cvtepi32_epi8(scaleAVX512(pairsAVX512(cu[2], cu[3]), 512, 10, 128)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(v + it / 2), _mm512_cvtepi32_epi8(scaleAVX512(pairsAVX512(cv[0], cv[1]), 512, 10, 128)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(v + it / 2 + 16), _mm512_cvtepi32_epi8(scaleAVX512(pairsAVX512(cv[2], cv[3]), 512, 10, 128)));
+        }
+
+        convertRowsAVX2(src0 + it, src1 + it, y0 + it, y1 + it, u + it / 2, v + it / 2, width - it);
+    }
+
+#pragma GCC diagnostic pop
+#endif
+
+    bool equalScalar(const uint8_t* a, const uint8_t* b, size_t len)
+    {
+        return 0 == std::memcmp(a, b, len);
+    }
+
+#ifdef COLOR_CONVERT_X86
+    // xor the blocks, or them together, one test per block: no branch per vector
+    __attribute__((target("sse4.1")))
+    bool equalSSE41(const uint8_t* a, const uint8_t* b, size_t len)
+    {
+        size_t it = 0;
+
+        for(; it + 64 <= len; it += 64)
+        {
+            __m128i acc = _mm_setzero_si128();
+
+            for(int k = 0; k < 64; k += 16)
+                acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + it + k)),
+                                                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + it + k))));
+
+            if(! _mm_testz_si128(acc, acc))
+                return false;
+        }
+
+        return equalScalar(a + it, b + it, len - it);
+    }
+
+    __attribute__((target("avx2")))
+    bool equalAVX2(const uint8_t* a, const uint8_t* b, size_t len)
+    {
+        size_t it = 0;
+
+        for(; it + 128 <= len; it += 128)
+        {
+            __m256i acc = _mm256_setzero_si256();
+
+            for(int k = 0; k < 128; k += 32)
+                acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + it + k)),
+                                                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + it + k))));
+
+            if(! _mm256_testz_si256(acc, acc))
+                return false;
+        }
+
+        return equalSSE41(a + it, b + it, len - it);
+    }
+#endif
+
+    void halveRowsScalar(const uint8_t* src0, const uint8_t* src1, uint32_t* dst, int width)
+    {
+        auto px0 = reinterpret_cast<const uint32_t*>(src0);
+        auto px1 = reinterpret_cast<const uint32_t*>(src1);
+
+        for(int it = 0; it < width; ++it)
+        {
+            uint32_t res = 0;
+
+            // x byte too, as pavgb
+            for(int shift = 0; shift < 32; shift += 8)
+            {
+                int a = average((px0[2 * it] >> shift) & 0xFF, (px1[2 * it] >> shift) & 0xFF);
+                int b = average((px0[2 * it + 1] >> shift) & 0xFF, (px1[2 * it + 1] >> shift) & 0xFF);
+                res |= uint32_t(average(a, b)) << shift;
+            }
+
+            dst[it] = res;
+        }
+    }
+
+#ifdef COLOR_CONVERT_X86
+    // rows averaged by pavgb, then even and odd pixels split by shufps and averaged
+    __attribute__((target("sse4.1")))
+    void halveRowsSSE41(const uint8_t* src0, const uint8_t* src1, uint32_t* dst, int width)
+    {
+        int it = 0;
+
+        for(; it + 4 <= width; it += 4)
+        {
+            __m128 v0 = _mm_castsi128_ps(_mm_avg_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + it * 8)),
+                                                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + it * 8))));
+            __m128 v1 = _mm_castsi128_ps(_mm_avg_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + it * 8 + 16)),
+                                                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + it * 8 + 16))));
+
+            __m128i even = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odd = _mm_castps_si128(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + it), _mm_avg_epu8(even, odd));
+        }
+
+        halveRowsScalar(src0 + it * 8, src1 + it * 8, dst + it, width - it);
+    }
+
+    __attribute__((target("avx2")))
+    void halveRowsAVX2(const uint8_t* src0, const uint8_t* src1, uint32_t* dst, int width)
+    {
+        int it = 0;
+
+        for(; it + 8 <= width; it += 8)
+        {
+            __m256 v0 = _mm256_castsi256_ps(_mm256_avg_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + it * 8)),
+                                                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + it * 8))));
+            __m256 v1 = _mm256_castsi256_ps(_mm256_avg_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + it * 8 + 32)),
+                                                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + it * 8 + 32))));
+
+            // shufps stays in the lanes: pixel pairs 0 2 1 3 to 0 1 2 3
+            __m256i even = _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+            __m256i odd = _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + it),
+                                _mm256_permute4x64_epi64(_mm256_avg_epu8(even, odd), _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+
+        halveRowsSSE41(src0 + it * 8, src1 + it * 8, dst + it, width - it);
+    }
+#endif
+
+    struct KernelInfo
+    {
+        RowsFunc func;
+        EqualFunc equal;
+        HalveFunc halve;
+        const char* name;
+        const char* feature;
+    };
+
+    const KernelInfo kernels[] = {
+#ifdef COLOR_CONVERT_X86
+        // the compare and the box filter are memory bound, 256 bit is enough
+        { convertRowsAVX512, equalAVX2, halveRowsAVX2, "avx512", "avx512bw" },
+        { convertRowsAVX2, equalAVX2, halveRowsAVX2, "avx2", "avx2" },
+        { convertRowsSSE41, equalSSE41, halveRowsSSE41, "sse4.1", "sse4.1" },
+#endif
+        { convertRowsScalar, equalScalar, halveRowsScalar, "scalar", nullptr }
+    };
+
+    bool kernelSupported(const KernelInfo & info)
+    {
+        if(! info.feature)
+            return true;
+#ifdef COLOR_CONVERT_X86
+        __builtin_cpu_init();
+
+        // __builtin_cpu_supports wants a literal
+        if(0 == std::strcmp(info.feature, "avx512bw"))
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+        if(0 == std::strcmp(info.feature, "avx2"))
+            return __builtin_cpu_supports("avx2");
+        if(0 == std::strcmp(info.feature, "sse4.1"))
+            return __builtin_cpu_supports("sse4.1");
+#endif
+        return false;
+    }
+
+    struct Kernel
+    {
+        const KernelInfo* info = nullptr;
+
+        Kernel()
+        {
+            for(auto & it : kernels)
+            {
+                if(kernelSupported(it))
+                {
+                    info = & it;
+                    break;
+                }
+            }
+        }
+    };
+
+    Kernel & kernel(void)
+    {
+        static Kernel res;
+        return res;
+    }
+}
+
+const char* ColorConvert::kernelName(void)
+{
+    return kernel().info->name;
+}
+
+std::vector<const char*> ColorConvert::supportedKernels(void)
+{
+    std::vector<const char*> res;
+
+    for(auto & it : kernels)
+        if(kernelSupported(it)) res.push_back(it.name);
+
+    return res;
+}
+
+bool ColorConvert::selectKernel(const char* name)
+{
+    for(auto & it : kernels)
+    {
+        if(0 == std::strcmp(it.name, name) && kernelSupported(it))
+        {
+            kernel().info = & it;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ColorConvert::PixelLayout ColorConvert::pixelLayout(int bitsPerPixel, uint32_t redMask, uint32_t greenMask, uint32_t blueMask)
+{
+    const struct
+    {
+        PixelLayout layout;
+        int bpp;
+        uint32_t red, green, blue;
+    } layouts[] = {
+        { PixelLayout::BGRX32, 32, 0x00FF0000, 0x0000FF00, 0x000000FF },
+        { PixelLayout::RGBX32, 32, 0x000000FF, 0x0000FF00, 0x00FF0000 },
+        { PixelLayout::RGB565, 16, 0xF800, 0x07E0, 0x001F },
+        { PixelLayout::RGB555, 16, 0x7C00, 0x03E0, 0x001F },
+        { PixelLayout::RGB30, 32, 0x3FF00000, 0x000FFC00, 0x000003FF },
+        { PixelLayout::BGR30, 32, 0x000003FF, 0x000FFC00, 0x3FF00000 } };
+
+    for(auto & it : layouts)
+    {
+        if(it.bpp == bitsPerPixel && it.red == redMask && it.green == greenMask && it.blue == blueMask)
+            return it.layout;
+    }
+
+    return PixelLayout::Unknown;
+}
+
+const char* ColorConvert::layoutName(const PixelLayout & layout)
+{
+    switch(layout)
+    {
+        case PixelLayout::BGRX32: return "bgrx32";
+        case PixelLayout::RGBX32: return "rgbx32";
+        case PixelLayout::RGB565: return "rgb565";
+        case PixelLayout::RGB555: return "rgb555";
+        case PixelLayout::RGB30:  return "rgb30";
+        case PixelLayout::BGR30:  return "bgr30";
+        default: break;
+    }
+
+    return "unknown";
+}
+
+int ColorConvert::bytesPerPixel(const PixelLayout & layout)
+{
+    switch(layout)
+    {
+        case PixelLayout::RGB565:
+        case PixelLayout::RGB555: return 2;
+        case PixelLayout::Unknown: return 0;
+        default: break;
+    }
+
+    return 4;
+}
+
+bool ColorConvert::toI420(const PixelLayout & layout, const uint8_t* src, size_t srcPitch, int width, int height,
+                                uint8_t* const planes[3], const int linesize[3])
+{
+    if(! src || 0 >= width || 0 >= height || (width % 2) || (height % 2))
+        return false;
+
+    switch(layout)
+    {
+        case PixelLayout::BGRX32: return bgrxToI420(src, srcPitch, width, height, planes, linesize);
+        case PixelLayout::RGBX32: convertPacked<FormatRGBX32>(src, srcPitch, width, height, planes, linesize); return true;
+        case PixelLayout::RGB565: convertPacked<FormatRGB565>(src, srcPitch, width, height, planes, linesize); return true;
+        case PixelLayout::RGB555: convertPacked<FormatRGB555>(src, srcPitch, width, height, planes, linesize); return true;
+        case PixelLayout::RGB30:  convertPacked<FormatRGB30>(src, srcPitch, width, height, planes, linesize); return true;
+        case PixelLayout::BGR30:  convertPacked<FormatBGR30>(src, srcPitch, width, height, planes, linesize); return true;
+        default: break;
+    }
+
+    return false;
+}
+
+bool ColorConvert::toRGB32(const PixelLayout & layout, const uint8_t* src, size_t srcPitch, int width, int height,
+                                uint32_t* dst, size_t dstPitch)
+{
+    if(! src || ! dst || 0 >= width || 0 >= height)
+        return false;
+
+    switch(layout)
+    {
+        case PixelLayout::BGRX32: unpackRGB32<FormatBGRX32>(src, srcPitch, width, height, dst, dstPitch); return true;
+        case PixelLayout::RGBX32: unpackRGB32<FormatRGBX32>(src, srcPitch, width, height, dst, dstPitch); return true;
+        case PixelLayout::RGB565: unpackRGB32<FormatRGB565>(src, srcPitch, width, height, dst, dstPitch); return true;
+        case PixelLayout::RGB555: unpackRGB32<FormatRGB555>(src, srcPitch, width, height, dst, dstPitch); return true;
+        case PixelLayout::RGB30:  unpackRGB32<FormatRGB30>(src, srcPitch, width, height, dst, dstPitch); return true;
+        case PixelLayout::BGR30:  unpackRGB32<FormatBGR30>(src, srcPitch, width, height, dst, dstPitch); return true;
+        default: break;
+    }
+
+    return false;
+}
+
+bool ColorConvert::halfToI420(const PixelLayout & layout, const uint8_t* src, size_t srcPitch, int width, int height,
+                                uint8_t* const planes[3], const int linesize[3])
+{
+    if(! src || 0 >= width || 0 >= height || (width % 2) || (height % 2))
+        return false;
+
+    HalveFunc halve = nullptr;
+
+    switch(layout)
+    {
+        case PixelLayout::BGRX32: halve = kernel().info->halve; break;
+        case PixelLayout::RGBX32: halve = halveRowsPacked<FormatRGBX32>; break;
+        case PixelLayout::RGB565: halve = halveRowsPacked<FormatRGB565>; break;
+        case PixelLayout::RGB555: halve = halveRowsPacked<FormatRGB555>; break;
+        case PixelLayout::RGB30:  halve = halveRowsPacked<FormatRGB30>; break;
+        case PixelLayout::BGR30:  halve = halveRowsPacked<FormatBGR30>; break;
+        default: return false;
+    }
+
+    // two downscaled rows, they stay in the cache until converted
+    thread_local std::vector<uint32_t> rows;
+    rows.resize(2 * width);
+
+    auto func = kernel().info->func;
+
+    for(int row = 0; row < height; row += 2)
+    {
+        const uint8_t* line = src + 2 * row * srcPitch;
+
+        halve(line, line + srcPitch, rows.data(), width);
+        halve(line + 2 * srcPitch, line + 3 * srcPitch, rows.data() + width, width);
+
+        func(rows.data(), rows.data() + width,
+            planes[0] + row * linesize[0], planes[0] + (row + 1) * linesize[0],
+            planes[1] + (row / 2) * linesize[1], planes[2] + (row / 2) * linesize[2], width);
+    }
+
+    return true;
+}
+
+bool ColorConvert::bgrxToI420(const uint8_t* src, size_t srcPitch, int width, int height,
+                                uint8_t* const planes[3], const int linesize[3])
+{
+    if(! src || 0 >= width || 0 >= height || (width % 2) || (height % 2))
+        return false;
+
+    auto func = kernel().info->func;
+
+    for(int row = 0; row < height; row += 2)
+    {
+        func(reinterpret_cast<const uint32_t*>(src + row * srcPitch),
+            reinterpret_cast<const uint32_t*>(src + (row + 1) * srcPitch),
+            planes[0] + row * linesize[0], planes[0] + (row + 1) * linesize[0],
+            planes[1] + (row / 2) * linesize[1], planes[2] + (row / 2) * linesize[2], width);
+    }
+
+    return true;
+}
+
+bool ColorConvert::blockEqual(const uint8_t* a, size_t pitchA, const uint8_t* b, size_t pitchB, size_t bytes, int rows)
+{
+    auto func = kernel().info->equal;
+
+    for(int row = 0; row < rows; ++row)
+    {
+        if(! func(a + row * pitchA, b + row * pitchB, bytes))
+            return false;
+    }
+
+    return true;
+}
+
+/* SliceWorkers */
+ColorConvert::SliceWorkers::SliceWorkers(int count)
+{
+    for(int band = 1; band < count; ++band)
+        threads.emplace_back(& SliceWorkers::loop, this, band);
+}
+
+ColorConvert::SliceWorkers::~SliceWorkers()
+{
+    {
+        const std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+
+    startCond.notify_all();
+
+    for(auto & th : threads)
+        th.join();
+}
+
+void ColorConvert::SliceWorkers::loop(int band)
+{
+    uint64_t seen = 0;
+
+    while(true)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        startCond.wait(guard, [&]{ return stop || seen != generation; });
+
+        if(stop)
+            break;
+
+        seen = generation;
+        guard.unlock();
+
+        job(band);
+
+        guard.lock();
+
+        if(0 == --pending)
+            doneCond.notify_one();
+    }
+}
+
+void ColorConvert::SliceWorkers::run(const std::function<void(int band)> & func)
+{
+    if(threads.empty())
+    {
+        func(0);
+        return;
+    }
+
+    {
+        const std::lock_guard<std::mutex> guard(lock);
+        job = func;
+        pending = threads.size();
+        generation++;
+    }
+
+    startCond.notify_all();
+    func(0);
+
+    std::unique_lock<std::mutex> guard(lock);
+    doneCond.wait(guard, [this]{ return 0 == pending; });
+}
+
+std::pair<int, int> ColorConvert::SliceWorkers::bandRows(int height, int bands, int band)
+{
+    // row pairs split evenly, the chroma rows stay within one band
+    int pairs = height / 2;
+    int first = pairs * band / bands;
+    int last = pairs * (band + 1) / bands;
+
+    int row = first * 2;
+    int rows = (last - first) * 2;
+
+    if(band == bands - 1)
+        rows = height - row;
+
+    return std::make_pair(row, rows);
+}
+
+int ColorConvert::SliceWorkers::autoCount(int width, int height)
+{
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    int mpix = (size_t(width) * height + 999999) / 1000000;
+
+    return std::clamp(mpix, 1, cores);
+}
@@ -0,0 +1,116 @@
+/***************************************************************************
+ *   Copyright © 2022 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   Part of the XcbWindowCapture                                          *
+ *   https://github.com/AndreyBarmaley/xcb-window-capture                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef COLOR_CONVERT_H
+#define COLOR_CONVERT_H
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <functional>
+#include <condition_variable>
+
+namespace ColorConvert
+{
+    /// packed pixel layouts of the true color visuals, channels named from the most significant bits
+    /// BGRX32: x8r8g8b8 (0x00RRGGBB), RGBX32: x8b8g8r8, RGB565: depth 16, RGB555: depth 15, RGB30/BGR30: depth 30
+    enum class PixelLayout { Unknown, BGRX32, RGBX32, RGB565, RGB555, RGB30, BGR30 };
+
+    /// layout from the bits per pixel and the visual masks, Unknown for the rest
+    PixelLayout pixelLayout(int bitsPerPixel, uint32_t redMask, uint32_t greenMask, uint32_t blueMask);
+
+    const char* layoutName(const PixelLayout &);
+    int bytesPerPixel(const PixelLayout &);
+
+    /// convert a frame of any known layout to yuv420p, bgrx by bgrxToI420
+    /// other layouts by the converter built for them, straight to the planes
+    bool toI420(const PixelLayout &, const uint8_t* src, size_t srcPitch, int width, int height,
+                    uint8_t* const planes[3], const int linesize[3]);
+
+    /// convert and downscale 2:1 in one pass: each output pixel is the 2x2 box average of the source
+    /// width and height of the output, even; the source is twice as large
+    bool halfToI420(const PixelLayout &, const uint8_t* src, size_t srcPitch, int width, int height,
+                    uint8_t* const planes[3], const int linesize[3]);
+
+    /// convert a frame of any known layout to 0xffRRGGBB pixels, for the preview
+    bool toRGB32(const PixelLayout &, const uint8_t* src, size_t srcPitch, int width, int height,
+                    uint32_t* dst, size_t dstPitch);
+
+    /// convert a bgrx frame (native 0x00RRGGBB pixels) to yuv420p of the same size
+    /// bt.601 limited range as swscale, chroma is the 2x2 average
+    /// width and height even, otherwise false and nothing written
+    bool bgrxToI420(const uint8_t* src, size_t srcPitch, int width, int height,
+                    uint8_t* const planes[3], const int linesize[3]);
+
+    /// compare rows bytes wide of two images, stops at the first differing row
+    bool blockEqual(const uint8_t* a, size_t pitchA, const uint8_t* b, size_t pitchB, size_t bytes, int rows);
+
+    /// selected kernel name: avx512, avx2, sse4.1 or scalar
+    const char* kernelName(void);
+
+    /// kernels the cpu runs, the best first
+    std::vector<const char*> supportedKernels(void);
+
+    /// force one of the supported kernels, for benchmarks
+    bool selectKernel(const char* name);
+
+    /// SliceWorkers: persistent threads, a frame converted in horizontal bands, one band per thread
+    class SliceWorkers
+    {
+        std::vector<std::thread> threads;
+        std::mutex lock;
+        std::condition_variable startCond;
+        std::condition_variable doneCond;
+
+        std::function<void(int)> job;
+        uint64_t generation = 0;
+        int pending = 0;
+        bool stop = false;
+
+        void loop(int band);
+
+    public:
+        /// count bands, the caller thread runs the first one
+        explicit SliceWorkers(int count);
+        ~SliceWorkers();
+
+        SliceWorkers(const SliceWorkers &) = delete;
+        SliceWorkers & operator=(const SliceWorkers &) = delete;
+
+        int count(void) const { return threads.size() + 1; }
+
+        /// job(band) for all bands, returns when all are done
+        void run(const std::function<void(int band)> &);
+
+        /// first row and rows of a band, rows even except the last band of an odd height
+        static std::pair<int, int> bandRows(int height, int bands, int band);
+
+        /// bands for a frame size: about one per megapixel, within the cores
+        static int autoCount(int width, int height);
+    };
+}
+
+#endif // COLOR_CONVERT_H
@@ -0,0 +1,268 @@
+/***************************************************************************
+ *   Copyright © 2022 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   Part of the XcbWindowCapture                                          *
+ *   https://github.com/AndreyBarmaley/xcb-window-capture                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CURSOR_BLEND_X86
+#endif
+
+#include "cursorblend.h"
+
+namespace CursorBlend
+{
+    typedef void (*RowFunc)(uint32_t* dst, const uint32_t* src, int count);
+
+    // both are 0xAARRGGBB as native uint32, premultiplied: d = s + d * (255 - a) / 255
+    inline uint32_t div255(uint32_t v)
+    {
+        v += 128;
+        return (v + (v >> 8)) >> 8;
+    }
+
+    void blendRowScalar(uint32_t* dst, const uint32_t* src, int count)
+    {
+        for(int it = 0; it < count; ++it)
+        {
+            uint32_t s = src[it];
+            uint32_t a = s >> 24;
+
+            if(0 == a)
+                continue;
+
+            if(255 == a)
+            {
+                dst[it] = s;
+                continue;
+            }
+
+            uint32_t d = dst[it];
+            uint32_t inv = 255 - a;
+            uint32_t res = 0;
+
+            for(int shift = 0; shift < 32; shift += 8)
+            {
+                uint32_t c = ((s >> shift) & 0xFF) + div255(((d >> shift) & 0xFF) * inv);
+                res |= std::min(c, 255u) << shift;
+            }
+
+            dst[it] = res;
+        }
+    }
+
+#ifdef CURSOR_BLEND_X86
+    // 16 bit lanes, pairs of pixels: div255 of s8 + d16 * inv16
+    __attribute__((target("sse2")))
+    inline __m128i blendLanesSSE2(__m128i s16, __m128i d16)
+    {
+        const __m128i c255 = _mm_set1_epi16(255);
+        const __m128i c128 = _mm_set1_epi16(128);
+
+        // broadcast alpha words: 3 and 7
+        __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xFF), 0xFF);
+        __m128i m = _mm_add_epi16(_mm_mullo_epi16(d16, _mm_sub_epi16(c255, a)), c128);
+        return _mm_srli_epi16(_mm_add_epi16(m, _mm_srli_epi16(m, 8)), 8);
+    }
+
+    __attribute__((target("sse2")))
+    void blendRowSSE2(uint32_t* dst, const uint32_t* src, int count)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        int it = 0;
+
+        for(; it + 4 <= count; it += 4)
+        {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + it));
+
+            // transparent block, frequent around the cursor shape
+            if(0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(s, 24), zero)))
+                continue;
+
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + it));
+            __m128i lo = blendLanesSSE2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+            __m128i hi = blendLanesSSE2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + it), _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+        }
+
+        blendRowScalar(dst + it, src + it, count - it);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i blendLanesAVX2(__m256i s16, __m256i d16)
+    {
+        const __m256i c255 = _mm256_set1_epi16(255);
+        const __m256i c128 = _mm256_set1_epi16(128);
+
+        __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s16, 0xFF), 0xFF);
+        __m256i m = _mm256_add_epi16(_mm256_mullo_epi16(d16, _mm256_sub_epi16(c255, a)), c128);
+        return _mm256_srli_epi16(_mm256_add_epi16(m, _mm256_srli_epi16(m, 8)), 8);
+    }
+
+    __attribute__((target("avx2")))
+    void blendRowAVX2(uint32_t* dst, const uint32_t* src, int count)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        int it = 0;
+
+        for(; it + 8 <= count; it += 8)
+        {
+            __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + it));
+
+            if(-1 == _mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_srli_epi32(s, 24), zero)))
+                continue;
+
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + it));
+            // unpack and pack work per 128 bit lane, the pixel order is kept
+            __m256i lo = blendLanesAVX2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+            __m256i hi = blendLanesAVX2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + it), _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)));
+        }
+
+        blendRowSSE2(dst + it, src + it, count - it);
+    }
+#endif
+
+    struct KernelInfo
+    {
+        RowFunc func;
+        const char* name;
+    };
+
+    const KernelInfo kernels[] = {
+#ifdef CURSOR_BLEND_X86
+        { blendRowAVX2, "avx2" },
+        { blendRowSSE2, "sse2" },
+#endif
+        { blendRowScalar, "scalar" }
+    };
+
+    bool kernelSupported(const KernelInfo & info)
+    {
+#ifdef CURSOR_BLEND_X86
+        __builtin_cpu_init();
+
+        if(info.func == blendRowAVX2)
+            return __builtin_cpu_supports("avx2");
+        if(info.func == blendRowSSE2)
+            return __builtin_cpu_supports("sse2");
+#endif
+        return true;
+    }
+
+    struct Kernel
+    {
+        const KernelInfo* info = nullptr;
+
+        Kernel()
+        {
+            for(auto & it : kernels)
+            {
+                if(kernelSupported(it))
+                {
+                    info = & it;
+                    break;
+                }
+            }
+        }
+    };
+
+    Kernel & kernel(void)
+    {
+        static Kernel res;
+        return res;
+    }
+}
+
+const char* CursorBlend::kernelName(void)
+{
+    return kernel().info->name;
+}
+
+std::vector<const char*> CursorBlend::supportedKernels(void)
+{
+    std::vector<const char*> res;
+
+    for(auto & it : kernels)
+        if(kernelSupported(it)) res.push_back(it.name);
+
+    return res;
+}
+
+bool CursorBlend::selectKernel(const char* name)
+{
+    for(auto & it : kernels)
+    {
+        if(0 == std::strcmp(it.name, name) && kernelSupported(it))
+        {
+            kernel().info = & it;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void CursorBlend::blendBGRX(uint8_t* frame, int frameWidth, int frameHeight, size_t framePitch,
+                            const uint32_t* cursor, int cursorWidth, int cursorHeight, int x, int y)
+{
+    if(! frame || ! cursor)
+        return;
+
+    // clip to frame
+    int left = std::max(0, -x);
+    int top = std::max(0, -y);
+    int right = std::min(cursorWidth, frameWidth - x);
+    int bottom = std::min(cursorHeight, frameHeight - y);
+
+    if(left >= right || top >= bottom)
+        return;
+
+    auto func = kernel().info->func;
+
+    for(int row = top; row < bottom; ++row)
+    {
+        auto dst = reinterpret_cast<uint32_t*>(frame + (y + row) * framePitch) + x + left;
+        func(dst, cursor + row * cursorWidth + left, right - left);
+    }
+}
+
+void CursorBlend::blendRGBX(uint8_t* frame, int frameWidth, int frameHeight, size_t framePitch,
+                            const uint32_t* cursor, int cursorWidth, int cursorHeight, int x, int y)
+{
+    if(! frame || ! cursor)
+        return;
+
+    // the blend is per channel: red and blue swapped in a copy of the cursor, 64x64 at most usually
+    thread_local std::vector<uint32_t> swapped;
+    swapped.resize(cursorWidth * cursorHeight);
+
+    std::transform(cursor, cursor + swapped.size(), swapped.begin(), [](uint32_t px)
+    {
+        return (px & 0xFF00FF00) | ((px >> 16) & 0xFF) | ((px & 0xFF) << 16);
+    });
+
+    blendBGRX(frame, frameWidth, frameHeight, framePitch, swapped.data(), cursorWidth, cursorHeight, x, y);
+}
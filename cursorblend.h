@@ -0,0 +1,51 @@
+/***************************************************************************
+ *   Copyright © 2022 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   Part of the XcbWindowCapture                                          *
+ *   https://github.com/AndreyBarmaley/xcb-window-capture                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef CURSOR_BLEND_H
+#define CURSOR_BLEND_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace CursorBlend
+{
+    /// blend a premultiplied argb cursor over a little-endian bgrx frame at x, y
+    /// the cursor is clipped to the frame, partly visible cursors are drawn
+    void blendBGRX(uint8_t* frame, int frameWidth, int frameHeight, size_t framePitch,
+                    const uint32_t* cursor, int cursorWidth, int cursorHeight, int x, int y);
+
+    /// the same over a little-endian rgbx frame, the cursor channels swapped
+    void blendRGBX(uint8_t* frame, int frameWidth, int frameHeight, size_t framePitch,
+                    const uint32_t* cursor, int cursorWidth, int cursorHeight, int x, int y);
+
+    /// selected kernel name: avx2, sse2 or scalar
+    const char* kernelName(void);
+
+    /// kernels the cpu runs, the best first
+    std::vector<const char*> supportedKernels(void);
+
+    /// force one of the supported kernels, for benchmarks
+    bool selectKernel(const char* name);
+}
+
+#endif // CURSOR_BLEND_H
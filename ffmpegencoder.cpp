@@ -22,10 +22,15 @@
 
 #include <QDebug>
 
+#include <cstring>
 #include <iostream>
 #include <exception>
 #include <algorithm>
 
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
 #include "ffmpegencoder.h"
 
 namespace FFMPEG
@@ -61,6 +66,33 @@ namespace FFMPEG
         return AV_SAMPLE_FMT_NONE;
     }
 
+    const char* VideoScaler::name(const VideoScaler::type & scaler)
+    {
+        switch(scaler)
+        {
+            case VideoScaler::Area:      return "area";
+            case VideoScaler::Bilinear:  return "bilinear";
+            case VideoScaler::Point:     return "point";
+            case VideoScaler::Box:       return "box 2:1";
+            default: break;
+        }
+
+        return nullptr;
+    }
+
+    int VideoScaler::swsFlags(const VideoScaler::type & scaler)
+    {
+        switch(scaler)
+        {
+            case VideoScaler::Bilinear:  return SWS_BILINEAR;
+            case VideoScaler::Point:     return SWS_POINT;
+            default: break;
+        }
+
+        // box too, for the sizes it does not cover
+        return SWS_AREA;
+    }
+
     QString errorString(int errnum)
     {
         char errbuf[1024]{0};
@@ -128,7 +160,47 @@ namespace FFMPEG
         return avcodec_fill_audio_frame(frame, frame->ch_layout.nb_channels, (AVSampleFormat) frame->format, buf, len, align);
     }
 
-    void VideoFrame::init(const AVPixelFormat & format, int width, int height)
+    void hugeBufferFree(void* opaque, uint8_t* data)
+    {
+        munmap(data, reinterpret_cast<size_t>(opaque));
+    }
+
+    AVBufferRef* hugeBufferAlloc(size_t size, const char** backing)
+    {
+        const size_t hugepagesz = 2 * 1024 * 1024;
+        size = ((size + hugepagesz - 1) / hugepagesz) * hugepagesz;
+
+        // reserved hugetlb pool first, fails without vm.nr_hugepages
+        auto ptr = reinterpret_cast<uint8_t*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+        *backing = "hugetlb";
+
+        if(ptr == MAP_FAILED)
+        {
+            // transparent hugepages: map one page more and trim to the 2MB boundary
+            auto raw = reinterpret_cast<uint8_t*>(mmap(nullptr, size + hugepagesz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if(raw == MAP_FAILED)
+                return nullptr;
+
+            ptr = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(raw) + hugepagesz - 1) & ~(hugepagesz - 1));
+
+            if(ptr > raw)
+                munmap(raw, ptr - raw);
+
+            if(size_t tail = (raw + size + hugepagesz) - (ptr + size))
+                munmap(ptr + size, tail);
+
+            // thp disabled: still 4k pages, only aligned
+            *backing = 0 == madvise(ptr, size, MADV_HUGEPAGE) ? "thp" : "4k";
+        }
+
+        auto buf = av_buffer_create(ptr, size, hugeBufferFree, reinterpret_cast<void*>(size), 0);
+        if(! buf)
+            munmap(ptr, size);
+
+        return buf;
+    }
+
+    void VideoFrame::init(const AVPixelFormat & format, int width, int height, bool hugePages)
     {
         auto frame = av_frame_alloc();
         if(! frame)
@@ -139,6 +211,29 @@ namespace FFMPEG
         frame->format = format;
 
         reset(frame);
+        backing = "4k";
+
+        if(hugePages)
+        {
+            int size = av_image_get_buffer_size(format, width, height, 32);
+            if(0 > size)
+                throw FFMPEG::runtimeException("av_image_get_buffer_size", size);
+
+            // all planes in one buffer, owned by the frame as buf[0]
+            if(auto buf = hugeBufferAlloc(size, & backing))
+            {
+                frame->buf[0] = buf;
+
+                int ret = av_image_fill_arrays(frame->data, frame->linesize, buf->data, format, width, height, 32);
+                if(0 > ret)
+                    throw FFMPEG::runtimeException("av_image_fill_arrays", ret);
+
+                return;
+            }
+
+            qWarning() << "video frame hugepages alloc failed, error:" << strerror(errno);
+            backing = "4k";
+        }
 
         int ret = av_frame_get_buffer(frame, 32);
         if(0 > ret)
@@ -226,6 +321,28 @@ namespace FFMPEG
 
     void VideoEncoder::start(int width, int height)
     {
+        captureWidth = width;
+        captureHeight = height;
+        tileScale = 1;
+
+        if(outputScale < 100)
+        {
+            if(VideoScaler::Box == scaler && 50 != outputScale)
+            {
+                qWarning() << "video scaler: box is 2:1 only, area used";
+                scaler = VideoScaler::Area;
+            }
+
+            if(VideoScaler::Box == scaler)
+                tileScale = 2;
+
+            width = width * outputScale / 100;
+            height = height * outputScale / 100;
+
+            qDebug() << QString("video output: %1x%2 -> %3x%4, scaler: %5").arg(captureWidth).arg(captureHeight)
+                                .arg(width).arg(height).arg(VideoScaler::name(scaler));
+        }
+
         // align width, height
         if(height % 2) height -= 1;
         if(width % 8) width -= (width % 8);
@@ -242,31 +359,346 @@ namespace FFMPEG
         if(0 > ret)
             throw FFMPEG::runtimeException("avcodec_open2", ret);
 
-        frame.init(AV_PIX_FMT_YUV420P, avcctx->width, avcctx->height);
+        frame.init(AV_PIX_FMT_YUV420P, avcctx->width, avcctx->height, hugePages);
+        qDebug() << "video frame backing:" << frame.backing;
+
+        // horizontal bands converted in parallel, one thread per band
+        int bands = 0 < convertThreads ? convertThreads : ColorConvert::SliceWorkers::autoCount(frame->width, frame->height);
+        bands = std::clamp(bands, 1, frame->height / 2);
+
+        workers = std::make_unique<ColorConvert::SliceWorkers>(bands);
+        qDebug() << "video convert:" << ColorConvert::kernelName() << ", threads:" << bands;
+
+        tileCols = (frame->width + tileSize - 1) / tileSize;
+        tileRows = (frame->height + tileSize - 1) / tileSize;
+        tileDirty.assign(tileCols * tileRows, 1);
+        tilesConverted = 0;
+        tilesFrames = 0;
+
+        resetLayout();
+
+        pts = 0;
+    }
 
+    AVPixelFormat VideoEncoder::avFormatFromLayout(const ColorConvert::PixelLayout & layout)
+    {
+        // native endian pixel values, as the converters read them
+        switch(layout)
+        {
 #if (__BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__)
-        AVPixelFormat avPixelFormat = AV_PIX_FMT_BGR0;
+            case ColorConvert::PixelLayout::BGRX32: return AV_PIX_FMT_BGR0;
+            case ColorConvert::PixelLayout::RGBX32: return AV_PIX_FMT_RGB0;
 #else
-        AVPixelFormat avPixelFormat = AV_PIX_FMT_0RGB;
+            case ColorConvert::PixelLayout::BGRX32: return AV_PIX_FMT_0RGB;
+            case ColorConvert::PixelLayout::RGBX32: return AV_PIX_FMT_0BGR;
 #endif
-        swsctx.reset(sws_getContext(avcctx->width, avcctx->height, avPixelFormat,
-                        frame->width, frame->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr));
+            case ColorConvert::PixelLayout::RGB565: return AV_PIX_FMT_RGB565;
+            case ColorConvert::PixelLayout::RGB555: return AV_PIX_FMT_RGB555;
+            case ColorConvert::PixelLayout::RGB30:  return AV_PIX_FMT_X2RGB10;
+            case ColorConvert::PixelLayout::BGR30:  return AV_PIX_FMT_X2BGR10;
+            default: break;
+        }
 
-        if(! swsctx)
-            throw std::runtime_error("sws_getContext failed");
+        return AV_PIX_FMT_NONE;
+    }
 
-        pts = 0;
+    void VideoEncoder::setLayout(const ColorConvert::PixelLayout & val)
+    {
+        if(layout == val)
+            return;
+
+        if(ColorConvert::PixelLayout::Unknown == val)
+            throw std::runtime_error("unsupported pixel layout");
+
+        qDebug() << "video pixel layout:" << ColorConvert::layoutName(val);
+
+        layout = val;
+        resetLayout();
+    }
+
+    void VideoEncoder::resetLayout(void)
+    {
+        srcFormat = avFormatFromLayout(layout);
+        pixelBytes = ColorConvert::bytesPerPixel(layout);
+
+        // the fit context and the kept frames are in the previous layout
+        fitctx.reset();
+        fitWidth = fitHeight = 0;
+
+        lastPixels.clear();
+        frameValid = lastValid = false;
+
+        scalectx.reset();
+
+        if(outputScale < 100 && 1 == tileScale)
+        {
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+            // sliced over the convert threads, by sws_scale_frame: sws_scale runs the first slice only
+            scalectx.reset(sws_alloc_context());
+
+            if(! scalectx)
+                throw std::runtime_error("sws_alloc_context failed");
+
+            av_opt_set_int(scalectx.get(), "srcw", captureWidth, 0);
+            av_opt_set_int(scalectx.get(), "srch", captureHeight, 0);
+            av_opt_set_pixel_fmt(scalectx.get(), "src_format", srcFormat, 0);
+            av_opt_set_int(scalectx.get(), "dstw", frame->width, 0);
+            av_opt_set_int(scalectx.get(), "dsth", frame->height, 0);
+            av_opt_set_pixel_fmt(scalectx.get(), "dst_format", AV_PIX_FMT_YUV420P, 0);
+            av_opt_set_int(scalectx.get(), "sws_flags", VideoScaler::swsFlags(scaler), 0);
+            av_opt_set_int(scalectx.get(), "threads", workers->count(), 0);
+
+            int ret = sws_init_context(scalectx.get(), nullptr, nullptr);
+            if(0 > ret)
+                throw FFMPEG::runtimeException("sws_init_context", ret);
+#else
+            scalectx.reset(sws_getContext(captureWidth, captureHeight, srcFormat,
+                        frame->width, frame->height, AV_PIX_FMT_YUV420P, VideoScaler::swsFlags(scaler), nullptr, nullptr, nullptr));
+
+            if(! scalectx)
+                throw std::runtime_error("sws_getContext failed");
+#endif
+        }
+    }
+
+    void VideoEncoder::encodeFrame(const uint8_t* pixels, int pitch, int width, int height, const QRegion* damage)
+    {
+        // source of the tiles: the frame size, or twice it for the box filter
+        const int srcWidth = frame->width * tileScale;
+        const int srcHeight = frame->height * tileScale;
+
+        // not the start capture size (before the alignment): resized window
+        if(scalectx ? (width != captureWidth || height != captureHeight) :
+            (width < srcWidth || height < srcHeight || width - srcWidth >= 8 * tileScale || height - srcHeight >= 2 * tileScale))
+        {
+            fitFrame(pixels, pitch, width, height);
+            return;
+        }
+
+        if(scalectx)
+        {
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+            // the source frame is referenced by swscale: without a buffer it would be copied first
+            std::unique_ptr<AVFrame, AVFrameDeleter> src(av_frame_alloc());
+
+            if(! src)
+                throw std::runtime_error("av_frame_alloc failed");
+
+            src->format = srcFormat;
+            src->width = width;
+            src->height = height;
+            src->data[0] = const_cast<uint8_t*>(pixels);
+            src->linesize[0] = pitch;
+            // borrowed capture pixels, freed by their owner
+            src->buf[0] = av_buffer_create(src->data[0], pitch * height, [](void*, uint8_t*){}, nullptr, AV_BUFFER_FLAG_READONLY);
+
+            if(! src->buf[0])
+                throw std::runtime_error("av_buffer_create failed");
+
+            int ret = sws_scale_frame(scalectx.get(), frame.get(), src.get());
+            if(0 > ret)
+                throw FFMPEG::runtimeException("sws_scale_frame", ret);
+#else
+            const uint8_t* data[1] = { pixels };
+            int lines[1] = { pitch };
+
+            sws_scale(scalectx.get(), data, lines, 0, height, frame->data, frame->linesize);
+#endif
+
+            frame->pts = pts++;
+            fitWidth = fitHeight = 0;
+
+            writeFrame(frame.get());
+            return;
+        }
+
+        // damage known: trusted as is, otherwise the frames are compared
+        if(frameValid && (damage || lastValid))
+            markTiles(pixels, pitch, damage);
+        else
+            std::fill(tileDirty.begin(), tileDirty.end(), 1);
+
+        // the pixels copy is kept up to date only while there is no damage
+        bool keepPixels = ! damage;
+
+        // converted at the frame size, the aligned off columns and row are dropped
+        convertTiles(pixels, pitch, keepPixels);
+
+        frameValid = true;
+        lastValid = keepPixels;
+
+        frame->pts = pts++;
+        fitWidth = fitHeight = 0;
+
+        writeFrame(frame.get());
+    }
+
+    void VideoEncoder::markTiles(const uint8_t* pixels, int pitch, const QRegion* damage)
+    {
+        // tiles in the capture coordinates
+        const int srcTile = tileSize * tileScale;
+        const int srcWidth = frame->width * tileScale;
+        const int srcHeight = frame->height * tileScale;
+
+        if(damage)
+        {
+            std::fill(tileDirty.begin(), tileDirty.end(), 0);
+            const QRect srcRect(0, 0, srcWidth, srcHeight);
+
+            for(auto & rt : *damage)
+            {
+                auto area = rt.intersected(srcRect);
+                if(area.isEmpty())
+                    continue;
+
+                for(int ty = area.top() / srcTile; ty <= area.bottom() / srcTile; ++ty)
+                    std::fill_n(tileDirty.begin() + ty * tileCols + area.left() / srcTile, area.right() / srcTile - area.left() / srcTile + 1, 1);
+            }
+
+            return;
+        }
+
+        // no damage tracking: compare each tile with the previous frame, one band of tile rows per thread
+        const int linePitch = srcWidth * pixelBytes;
+        const int bands = workers->count();
+
+        workers->run([&](int band)
+        {
+            for(int ty = tileRows * band / bands; ty < tileRows * (band + 1) / bands; ++ty)
+            {
+                int row = ty * srcTile;
+                int rows = std::min(srcTile, srcHeight - row);
+
+                for(int tx = 0; tx < tileCols; ++tx)
+                {
+                    int col = tx * srcTile;
+                    int cols = std::min(srcTile, srcWidth - col);
+
+                    tileDirty[ty * tileCols + tx] = ! ColorConvert::blockEqual(pixels + row * pitch + col * pixelBytes, pitch,
+                                    lastPixels.data() + row * linePitch + col * pixelBytes, linePitch, cols * pixelBytes, rows);
+                }
+            }
+        });
     }
 
-    void VideoEncoder::encodeFrame(const uint8_t* pixels, int pitch, int height)
+    void VideoEncoder::convertTiles(const uint8_t* pixels, int pitch, bool keepPixels)
     {
+        const int linePitch = frame->width * tileScale * pixelBytes;
+        const int bands = workers->count();
+
+        if(keepPixels)
+            lastPixels.resize(linePitch * frame->height * tileScale);
+
+        size_t converted = std::count(tileDirty.begin(), tileDirty.end(), 1);
+
+        // widths and heights stay even: the frame is aligned, the tiles too
+        workers->run([&](int band)
+        {
+            for(int ty = tileRows * band / bands; ty < tileRows * (band + 1) / bands; ++ty)
+            {
+                int row = ty * tileSize;
+                int rows = std::min(tileSize, frame->height - row);
+
+                for(int tx = 0; tx < tileCols; ++tx)
+                {
+                    if(! tileDirty[ty * tileCols + tx])
+                        continue;
+
+                    int col = tx * tileSize;
+                    int cols = std::min(tileSize, frame->width - col);
+                    const uint8_t* src = pixels + row * tileScale * pitch + col * tileScale * pixelBytes;
+
+                    uint8_t* planes[3] = {
+                        frame->data[0] + row * frame->linesize[0] + col,
+                        frame->data[1] + (row / 2) * frame->linesize[1] + col / 2,
+                        frame->data[2] + (row / 2) * frame->linesize[2] + col / 2 };
+
+                    if(1 < tileScale)
+                        ColorConvert::halfToI420(layout, src, pitch, cols, rows, planes, frame->linesize);
+                    else
+                        ColorConvert::toI420(layout, src, pitch, cols, rows, planes, frame->linesize);
+
+                    if(keepPixels)
+                    {
+                        auto dst = lastPixels.data() + row * tileScale * linePitch + col * tileScale * pixelBytes;
+
+                        for(int line = 0; line < rows * tileScale; ++line)
+                            std::memcpy(dst + line * linePitch, src + line * pitch, cols * tileScale * pixelBytes);
+                    }
+                }
+            }
+        });
+
+        tilesConverted += converted;
+
+        if(0 == ++tilesFrames % 300)
+        {
+            qDebug() << QString("video tiles: %1% converted, %2 frames").arg(100.0 * tilesConverted / (tilesFrames * tileDirty.size()), 0, 'f', 1).arg(tilesFrames);
+            tilesConverted = 0;
+            tilesFrames = 0;
+        }
+    }
+
+    void VideoEncoder::clearFrame(void)
+    {
+        // black in the limited range yuv
+        for(int row = 0; row < frame->height; ++row)
+            std::fill_n(frame->data[0] + row * frame->linesize[0], frame->width, 16);
+
+        for(int row = 0; row < frame->height / 2; ++row)
+        {
+            std::fill_n(frame->data[1] + row * frame->linesize[1], frame->width / 2, 128);
+            std::fill_n(frame->data[2] + row * frame->linesize[2], frame->width / 2, 128);
+        }
+    }
+
+    void VideoEncoder::fitFrame(const uint8_t* pixels, int pitch, int width, int height)
+    {
+        // shrink only, a smaller capture stays at the output scale with borders
+        double scale = std::min(outputScale / 100.0, std::min(double(frame->width) / width, double(frame->height) / height));
+
+        // even sizes and offsets, the chroma planes are subsampled 2x2
+        int dstWidth = std::max(2, int(width * scale) & ~1);
+        int dstHeight = std::max(2, int(height * scale) & ~1);
+        int dstX = ((frame->width - dstWidth) / 2) & ~1;
+        int dstY = ((frame->height - dstHeight) / 2) & ~1;
+
+        if(dstWidth != fitWidth || dstHeight != fitHeight || dstX != fitX || dstY != fitY)
+        {
+            qDebug() << QString("video fit: %1x%2 -> %3x%4+%5+%6").arg(width).arg(height).arg(dstWidth).arg(dstHeight).arg(dstX).arg(dstY);
+
+            fitctx.reset(sws_getCachedContext(fitctx.release(), width, height, srcFormat,
+                        dstWidth, dstHeight, AV_PIX_FMT_YUV420P, VideoScaler::swsFlags(scaler), nullptr, nullptr, nullptr));
+
+            if(! fitctx)
+                throw std::runtime_error("sws_getCachedContext failed");
+
+            clearFrame();
+
+            fitX = dstX;
+            fitY = dstY;
+            fitWidth = dstWidth;
+            fitHeight = dstHeight;
+        }
+
         const uint8_t* data[1] = { pixels };
         int lines[1] = { pitch };
 
-        // align
-        if(height % 2) height -= 1;
-        
-        sws_scale(swsctx.get(), data, lines, 0, height, frame->data, frame->linesize);
+        uint8_t* planes[3] = {
+            frame->data[0] + fitY * frame->linesize[0] + fitX,
+            frame->data[1] + (fitY / 2) * frame->linesize[1] + fitX / 2,
+            frame->data[2] + (fitY / 2) * frame->linesize[2] + fitX / 2 };
+
+        sws_scale(fitctx.get(), data, lines, 0, height, planes, frame->linesize);
+        frame->pts = pts++;
+        frameValid = lastValid = false;
+
+        writeFrame(frame.get());
+    }
+
+    void VideoEncoder::repeatFrame(void)
+    {
+        // unchanged picture: skip the conversion, send the last frame again
         frame->pts = pts++;
 
         writeFrame(frame.get());
@@ -477,15 +909,32 @@ namespace FFMPEG
         avio_close(avfctx->pb);
     }
 
-    void H264Encoder::encodeFrame(const uint8_t* pixels, int pitch, int height)
+    void H264Encoder::encodeFrame(const uint8_t* pixels, int pitch, int width, int height, const QRegion* damage)
+    {
+        if(! audio || 0 >= av_compare_ts(video.pts, video.avcctx->time_base,
+                                            audio->pts, audio->avcctx->time_base))
+            video.encodeFrame(pixels, pitch, width, height, damage);
+        else
+        {
+            audio->encodeFrame();
+            video.encodeFrame(pixels, pitch, width, height, damage);
+        }
+    }
+
+    void H264Encoder::setPixelLayout(const ColorConvert::PixelLayout & layout)
+    {
+        video.setLayout(layout);
+    }
+
+    void H264Encoder::repeatFrame(void)
     {
         if(! audio || 0 >= av_compare_ts(video.pts, video.avcctx->time_base,
                                             audio->pts, audio->avcctx->time_base))
-            video.encodeFrame(pixels, pitch, height);
+            video.repeatFrame();
         else
         {
             audio->encodeFrame();
-            video.encodeFrame(pixels, pitch, height);
+            video.repeatFrame();
         }
     }
 }
@@ -24,6 +24,9 @@
 #define FFMPEG_ENCODER_H
 
 #include <memory>
+#include <vector>
+
+#include <QRegion>
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +37,8 @@ extern "C" {
 #include "libavformat/avformat.h"
 #include "libavformat/avio.h"
 #include "libavutil/timestamp.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
 #include "libswscale/swscale.h"
 #include "libswresample/swresample.h"
 
@@ -47,6 +52,7 @@ extern "C" {
 #endif
 
 #include "pulseaudio.h"
+#include "colorconvert.h"
 
 enum class AudioPlugin { None, PulseAudioSink, PulseAudioSource };
 
@@ -108,6 +114,14 @@ namespace FFMPEG
         const char* name(const type &);
     };
 
+    namespace VideoScaler
+    {
+        // box: 2:1 only, converted with the downscale by ColorConvert; the rest by swscale
+        enum type { Area = 1, Bilinear = 2, Point = 3, Box = 4 };
+        const char* name(const type &);
+        int swsFlags(const type &);
+    };
+
     struct runtimeException
     {
         const char* func;
@@ -146,9 +160,12 @@ namespace FFMPEG
 
     struct VideoFrame : AVFrameBase
     {
+        // planes memory: "hugetlb", "thp" or "4k"
+        const char* backing = "4k";
+
         VideoFrame() {}
 
-        void init(const AVPixelFormat &, int width, int height);
+        void init(const AVPixelFormat &, int width, int height, bool hugePages = false);
     };
 
     struct EncoderBase
@@ -170,17 +187,59 @@ namespace FFMPEG
 #else
         const AVCodec* codec = nullptr;
 #endif
-        std::unique_ptr<SwsContext, SwsContextDeleter> swsctx;
+        // conversion bands, one thread each
+        std::unique_ptr<ColorConvert::SliceWorkers> workers;
+        // downscale by swscale: converted and scaled in one call, the whole frame, sliced over the convert threads
+        std::unique_ptr<SwsContext, SwsContextDeleter> scalectx;
+        // capture resized while recording: shrink to fit the frame, centered, black borders
+        std::unique_ptr<SwsContext, SwsContextDeleter> fitctx;
 
         VideoFrame frame;
+        // captured pixels, converted by ColorConvert; srcFormat for the fit context
+        ColorConvert::PixelLayout layout = ColorConvert::PixelLayout::BGRX32;
+        AVPixelFormat srcFormat = AV_PIX_FMT_NONE;
+        int pixelBytes = 4;
+        // frame area written by fitctx, the rest is padding
+        int fitX = 0, fitY = 0, fitWidth = 0, fitHeight = 0;
 
         int fps = 25;
         int pts = 0;
+        bool hugePages = false;
+        // conversion bands, 0: by the frame size
+        int convertThreads = 0;
+        // output size in percent of the capture
+        int outputScale = 100;
+        VideoScaler::type scaler = VideoScaler::Area;
+        // capture size at start, source pixels per output pixel of the tiles: 1 or 2 (box)
+        int captureWidth = 0, captureHeight = 0;
+        int tileScale = 1;
+
+        // only the tiles changed since the previous frame are converted again
+        static constexpr int tileSize = 64;
+        int tileCols = 0, tileRows = 0;
+        std::vector<uint8_t> tileDirty;
+        // frame holds the previous capture, lastPixels its pixels copy for the compare
+        std::vector<uint8_t> lastPixels;
+        bool frameValid = false;
+        bool lastValid = false;
+        size_t tilesConverted = 0;
+        int tilesFrames = 0;
 
         void init(AVFormatContext*, const H264Preset::type & h264Preset, int bitrate);
         void start(int width, int height);
 
-        void encodeFrame(const uint8_t* pixels, int pitch, int height);
+        static AVPixelFormat avFormatFromLayout(const ColorConvert::PixelLayout &);
+        void setLayout(const ColorConvert::PixelLayout &);
+        void resetLayout(void);
+
+        void encodeFrame(const uint8_t* pixels, int pitch, int width, int height, const QRegion* damage = nullptr);
+        void repeatFrame(void);
+
+        void markTiles(const uint8_t* pixels, int pitch, const QRegion* damage);
+        void convertTiles(const uint8_t* pixels, int pitch, bool keepPixels);
+
+        void fitFrame(const uint8_t* pixels, int pitch, int width, int height);
+        void clearFrame(void);
     };
 
     struct AudioEncoder : EncoderBase
@@ -226,7 +285,9 @@ protected:
         void startRecord(const char* filename, int width, int height);
         void stopRecord(void);
 
-        void encodeFrame(const uint8_t* pixels, int pitch, int height);
+        void setPixelLayout(const ColorConvert::PixelLayout &);
+        void encodeFrame(const uint8_t* pixels, int pitch, int width, int height, const QRegion* damage = nullptr);
+        void repeatFrame(void);
     };
 }
 
@@ -25,12 +25,12 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 
-SOURCES += main.cpp mainsettings.cpp xcbwrapper.cpp ffmpegencoder.cpp pulseaudio.cpp
-HEADERS += mainsettings.h xcbwrapper.h ffmpegencoder.h pulseaudio.h
+SOURCES += main.cpp mainsettings.cpp xcbwrapper.cpp cursorblend.cpp colorconvert.cpp ffmpegencoder.cpp pulseaudio.cpp
+HEADERS += mainsettings.h xcbwrapper.h cursorblend.h colorconvert.h ffmpegencoder.h pulseaudio.h
 
 FORMS += mainsettings.ui
 INCLUDEPATH += /usr/include/ffmpeg /usr/include/compat-ffmpeg4
-LIBS += -lxcb-shm -lxcb -lavdevice -lavformat -lavcodec -lswscale -lswresample -lavutil -lpulse -lxcb-xfixes
+LIBS += -lxcb-shm -lxcb -lavdevice -lavformat -lavcodec -lswscale -lswresample -lavutil -lpulse -lxcb-xfixes -lxcb-damage -lxcb-randr -lxcb-present
 
 DISTFILES +=
 RESOURCES += resources.qrc
@@ -26,7 +26,6 @@
 #include <QImage>
 #include <QPixmap>
 #include <QRegExp>
-#include <QPainter>
 #include <QProcess>
 #include <QKeyEvent>
 #include <QTransform>
@@ -44,12 +43,14 @@
 #include <QDebug>
 
 #include <ctime>
+#include <algorithm>
 #include <chrono>
 #include <thread>
 #include <exception>
 
 #include "xcb/xfixes.h"
 
+#include "cursorblend.h"
 #include "labelpreview.h"
 #include "mainsettings.h"
 #include "ui_mainsettings.h"
@@ -79,6 +80,12 @@ MainSettings::MainSettings(QWidget* parent) :
         ui->comboBoxH264Preset->addItem(FFMPEG::H264Preset::name(type), type);
     }
     ui->comboBoxH264Preset->setCurrentIndex(ui->comboBoxH264Preset->findData(FFMPEG::H264Preset::Medium));
+
+    for(int scale : { 100, 75, 50, 33, 25 })
+        ui->comboBoxOutputScale->addItem(QString("%1%").arg(scale), scale);
+
+    for(auto type : { FFMPEG::VideoScaler::Area, FFMPEG::VideoScaler::Bilinear, FFMPEG::VideoScaler::Point, FFMPEG::VideoScaler::Box })
+        ui->comboBoxScaler->addItem(FFMPEG::VideoScaler::name(type), type);
     ui->pushButtonStart->setDisabled(true);
     ui->checkBoxShowCursor->setChecked(true);
 
@@ -132,12 +139,54 @@ MainSettings::MainSettings(QWidget* parent) :
         ui->checkBoxUseComposite->setToolTip("xcb-composite used");
     }
 
+    if(! xcb->getDamageExtension() || ! xcb->getShmExtension())
+    {
+        ui->checkBoxUseDamage->setChecked(false);
+        ui->checkBoxUseDamage->setDisabled(true);
+        ui->checkBoxUseDamage->setToolTip("xcb-damage or xcb-shm not found");
+    }
+    else
+    {
+        ui->checkBoxUseDamage->setToolTip("xcb-damage used, fetch only changed areas");
+    }
+
+    if(! xcb->getShmExtension() || ! xcb->getShmExtension()->hasSharedPixmaps())
+    {
+        ui->checkBoxUseCopyArea->setChecked(false);
+        ui->checkBoxUseCopyArea->setDisabled(true);
+        ui->checkBoxUseCopyArea->setToolTip("xcb-shm shared pixmaps not found");
+    }
+    else
+    {
+        ui->checkBoxUseCopyArea->setToolTip("xcb_copy_area into shm pixmap used, instead of xcb_shm_get_image");
+    }
+
+    if(! xcb->getPresentExtension() && ! xcb->getDamageExtension())
+    {
+        ui->checkBoxFrameSync->setChecked(false);
+        ui->checkBoxFrameSync->setDisabled(true);
+        ui->checkBoxFrameSync->setToolTip("xcb-present and xcb-damage not found");
+    }
+    else
+    {
+        ui->checkBoxFrameSync->setToolTip("capture after the window repaint: present complete notify, or damage");
+    }
+
+    ui->checkBoxHugePages->setToolTip("shm segments and video frame on 2MB pages, 4k pages if none available");
+    ui->spinBoxConvertThreads->setToolTip("frame color conversion split in bands, one per thread; auto: about one per megapixel");
+    ui->comboBoxOutputScale->setToolTip("encoded size in percent of the capture, converted and downscaled in one pass");
+    ui->comboBoxScaler->setToolTip("downscale filter; box 2:1: the fastest, at 50% only, area used for the other sizes;\n"
+                                    "the swscale filters convert the whole frame each time, unchanged areas are not skipped");
+
     connect(actionSettings, SIGNAL(triggered()), this, SLOT(show()));
     connect(actionStart, SIGNAL(triggered()), this, SLOT(startRecord()));
     connect(actionStop, SIGNAL(triggered()), this, SLOT(stopRecord()));
     connect(actionExit, SIGNAL(triggered()), this, SLOT(exitProgram()));
     connect(trayIcon, SIGNAL(activated(QSystemTrayIcon::ActivationReason)), this, SLOT(iconActivated(QSystemTrayIcon::ActivationReason)));
     connect(this, SIGNAL(updatePreviewNotify(quint32)), this, SLOT(updatePreviewLabel(quint32)));
+
+    qRegisterMetaType<QList<XcbWindowInfo>>("QList<XcbWindowInfo>");
+    connect(this, SIGNAL(windowListNotify(const QList<XcbWindowInfo> &)), this, SLOT(selectWindowsReady(const QList<XcbWindowInfo> &)), Qt::QueuedConnection);
     connect(ui->labelPreview, SIGNAL(rubberBandChanged(const QRect&)), this, SLOT(previewBandSelected(const QRect&)));
 
 /*
@@ -150,6 +199,9 @@ MainSettings::MainSettings(QWidget* parent) :
 
 MainSettings::~MainSettings()
 {
+    if(windowsThread.joinable())
+        windowsThread.join();
+
     delete ui;
 }
 
@@ -224,6 +276,15 @@ void MainSettings::configSave(void)
     // 20250316
     ds << ui->checkBoxRemoveWinDecor->isChecked();
     ds << ui->checkBoxUseComposite->isChecked();
+
+    // 20261016
+    ds << ui->checkBoxUseDamage->isChecked();
+    ds << ui->checkBoxUseCopyArea->isChecked();
+    ds << ui->checkBoxFrameSync->isChecked();
+    ds << ui->checkBoxHugePages->isChecked();
+    ds << ui->spinBoxConvertThreads->value();
+    ds << ui->comboBoxOutputScale->currentData().toInt();
+    ds << ui->comboBoxScaler->currentData().toInt();
 }
 
 void MainSettings::configLoad(void)
@@ -290,6 +351,34 @@ void MainSettings::configLoad(void)
         ds >> useComposite;
         ui->checkBoxUseComposite->setChecked(useComposite);
     }
+
+    if(20261015 < version)
+    {
+        bool useDamage;
+        ds >> useDamage;
+        ui->checkBoxUseDamage->setChecked(useDamage);
+
+        bool useCopyArea;
+        ds >> useCopyArea;
+        ui->checkBoxUseCopyArea->setChecked(useCopyArea);
+
+        bool frameSync;
+        ds >> frameSync;
+        ui->checkBoxFrameSync->setChecked(frameSync);
+
+        bool hugePages;
+        ds >> hugePages;
+        ui->checkBoxHugePages->setChecked(hugePages);
+
+        int convertThreads;
+        ds >> convertThreads;
+        ui->spinBoxConvertThreads->setValue(convertThreads);
+
+        int outputScale, scaler;
+        ds >> outputScale >> scaler;
+        ui->comboBoxOutputScale->setCurrentIndex(std::max(0, ui->comboBoxOutputScale->findData(outputScale)));
+        ui->comboBoxScaler->setCurrentIndex(std::max(0, ui->comboBoxScaler->findData(scaler)));
+    }
 }
 
 void MainSettings::previewBandSelected(const QRect& selection)
@@ -318,18 +407,20 @@ void MainSettings::updatePreviewLabel(quint32 win)
 
         if(reply)
         {
-            int bytePerPixel = xcb->bppFromDepth(reply->pixmapDepth()) >> 3;
-            int bytesPerLine = bytePerPixel * winsz.width();
-
-            if(reply->pixmapSize() > (uint32_t) (winsz.width() * winsz.height() * bytePerPixel))
-                    bytesPerLine += reply->pixmapSize() / (winsz.height() * bytePerPixel) - winsz.width();
+            int bytesPerLine = reply->pixmapSize() / winsz.height();
+            auto layout = xcb->pixelLayout(reply->pixmapDepth(), reply->pixmapVisual());
 
             auto width = ui->groupBoxPreview->width();
-            auto image = QImage(reply->pixmapData(), winsz.width(), winsz.height(), bytesPerLine, QImage::Format_RGBX8888);
+            auto image = QImage(winsz, QImage::Format_RGB32);
+
+            // any true color layout to 0xffRRGGBB, unknown ones stay black
+            if(! ColorConvert::toRGB32(layout, reply->pixmapData(), bytesPerLine, winsz.width(), winsz.height(),
+                                        reinterpret_cast<uint32_t*>(image.bits()), image.bytesPerLine()))
+            {
+                qWarning() << "unsupported pixel layout, depth:" << reply->pixmapDepth();
+                image.fill(Qt::black);
+            }
 
-#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
-            image = image.rgbSwapped();
-#endif
             originalSize = image.size();
             ui->labelPreview->setScaledContents(true);
             ui->labelPreview->setPixmap(QPixmap::fromImage(image.scaled(width, width, Qt::KeepAspectRatio)));
@@ -351,20 +442,48 @@ void MainSettings::updatePreviewLabel(quint32 win)
 }
 
 void MainSettings::selectWindows(void)
+{
+    // enumeration in progress
+    if(windowsBusy)
+        return;
+
+    if(windowsThread.joinable())
+        windowsThread.join();
+
+    windowsBusy = true;
+
+    // batched requests on a worker, the dialog stays responsive
+    windowsThread = std::thread([this]()
+    {
+        auto list = xcb->getWindowInfoList();
+        windowsBusy = false;
+        emit windowListNotify(list);
+    });
+}
+
+void MainSettings::selectWindowsReady(const QList<XcbWindowInfo> & list)
 {
     QMap<QString, xcb_window_t> windows;
+    QMap<QString, QRect> outputs;
     QString rootScreen("<root screen>");
 
     windows.insert(rootScreen, xcb->getScreenRoot());
 
-    for(auto win : xcb->getWindowList())
+    // single monitor: root with the crtc region
+    for(auto & output : xcb->getOutputList())
     {
-        auto parent = xcb->getWindowParent(win);
-        auto list = xcb->getPropertyStringList(win, XCB_ATOM_WM_CLASS);
-        auto name = xcb->getWindowName(win);
-        QString key = list.size() ? QString("0x%1 %2.%3 (%4)").arg(win, 0, 16).arg(list.front()).arg(list.back()).arg(name) : name;
+        auto & rt = output.geometry;
+        QString key = QString("<output %1 %2x%3+%4+%5>").arg(output.name).arg(rt.width()).arg(rt.height()).arg(rt.x()).arg(rt.y());
 
-        windows.insert(key, ui->checkBoxRemoveWinDecor->isChecked() ? win : parent);
+        windows.insert(key, xcb->getScreenRoot());
+        outputs.insert(key, rt);
+    }
+
+    for(auto & info : list)
+    {
+        QString key = info.wmClass.size() ? QString("0x%1 %2.%3 (%4)").arg(info.win, 0, 16).arg(info.wmClass.front()).arg(info.wmClass.back()).arg(info.name) : info.name;
+
+        windows.insert(key, ui->checkBoxRemoveWinDecor->isChecked() ? info.win : info.parent);
     }
 
     if(windows.size())
@@ -374,7 +493,7 @@ void MainSettings::selectWindows(void)
 
         if(ok && sel.size())
         {
-            if(sel == rootScreen)
+            if(sel == rootScreen || outputs.contains(sel))
             {
                 ui->checkBoxFocused->setChecked(false);
                 ui->checkBoxFocused->setDisabled(true);
@@ -386,6 +505,12 @@ void MainSettings::selectWindows(void)
 
             ui->lineEditWindowDescription->setText(sel);
             emit updatePreviewNotify(windows[sel]);
+
+            if(outputs.contains(sel))
+            {
+                auto & rt = outputs[sel];
+                ui->lineEditRegion->setText(QString("%1x%2+%3+%4").arg(rt.width() & ~7).arg(rt.height() & ~1).arg(rt.x()).arg(rt.y()));
+            }
         }
     }
 }
@@ -432,26 +557,6 @@ bool MainSettings::startRecord(void)
             }
         }
 
-        auto composite = ui->checkBoxUseComposite->isChecked() ?
-                xcb->getCompositeExtension() : nullptr;
-
-        if(composite)
-        {
-            if(composite->redirectWindow(xcb->connection(), windowId))
-            {
-                if(! composite->redirectSubWindows(xcb->connection(), windowId))
-                {
-                    qWarning() << "composite redirect window failed";
-                }
-
-                compositeId = composite->nameWindowPixmap(xcb->connection(), windowId);
-            }
-            else
-            {
-                qWarning() << "composite redirect window failed";
-            }
-        }
-
         // check preffered region
         auto winsz = xcb->getWindowSize(windowId);
         auto realRegion = QRect(QPoint(0, 0), winsz);
@@ -474,6 +579,14 @@ bool MainSettings::startRecord(void)
         auto fileFormat = ui->lineEditOutputFile->text();
         bool renderCursor = ui->checkBoxShowCursor->isChecked();
         bool startFocused = ui->checkBoxFocused->isChecked();
+        bool useComposite = ui->checkBoxUseComposite->isChecked() && xcb->getCompositeExtension();
+        bool useDamage = ui->checkBoxUseDamage->isChecked();
+        bool useCopyArea = ui->checkBoxUseCopyArea->isChecked();
+        bool frameSync = ui->checkBoxFrameSync->isChecked();
+        bool hugePages = ui->checkBoxHugePages->isChecked();
+        int convertThreads = ui->spinBoxConvertThreads->value();
+        int outputScale = ui->comboBoxOutputScale->currentData().toInt();
+        auto scaler = static_cast<FFMPEG::VideoScaler::type>(ui->comboBoxScaler->currentData().toInt());
 
         AudioPlugin audioPlugin = AudioPlugin::None;
         if(ui->comboBoxAudioPlugin->currentText() == "default sink")
@@ -487,7 +600,10 @@ bool MainSettings::startRecord(void)
 
         try
         {
-            encoder.reset(new FFmpegEncoderPool(h264Preset, videoBitrate, windowId, compositeId, prefRegion, xcb, fileFormat.toStdString(), renderCursor, startFocused, audioPlugin, audioBitrate, this));
+            // own connection for the recorder thread, the gui requests do not stall the capture
+            // the composite redirect and pixmap belong to it, renamed there on resize
+            auto recordConn = std::make_shared<XcbConnection>();
+            encoder.reset(new FFmpegEncoderPool(h264Preset, videoBitrate, windowId, prefRegion, recordConn, fileFormat.toStdString(), renderCursor, startFocused, useComposite, useDamage, useCopyArea, frameSync, hugePages, convertThreads, outputScale, scaler, audioPlugin, audioBitrate, this));
         }
         catch(const FFMPEG::runtimeException & err)
         {
@@ -511,7 +627,6 @@ bool MainSettings::startRecord(void)
             connect(encoder.get(), SIGNAL(startedNotify(quint32)), this, SLOT(startedRecord(quint32)));
             connect(encoder.get(), SIGNAL(shutdownNotify()), this, SLOT(exitProgram()));
             connect(encoder.get(), SIGNAL(errorNotify(QString)), this, SLOT(stopRecord(QString)));
-            connect(encoder.get(), SIGNAL(restartNotify()), this, SLOT(restartRecord()));
             encoder->start();
             return true;
         }
@@ -533,26 +648,8 @@ void MainSettings::startedRecord(quint32 wid)
     actionStop->setEnabled(true);
 }
 
-void MainSettings::restartRecord(void)
-{
-    stopRecord();
-    startRecord();
-}
-
 void MainSettings::stopRecord(QString error)
 {
-    if(compositeId != XCB_PIXMAP_NONE)
-    {
-        if(auto composite = xcb->getCompositeExtension())
-        {
-            composite->unredirectSubWindows(xcb->connection(), windowId);
-            composite->unredirectWindow(xcb->connection(), windowId);
-        }
-
-        xcb_free_pixmap(xcb->connection(), compositeId);
-        compositeId = XCB_PIXMAP_NONE;
-    }
-
     windowId = XCB_WINDOW_NONE;
 
     ui->lineEditWindowDescription->clear();
@@ -585,10 +682,15 @@ void MainSettings::stopRecord(void)
 }
 
 /* FFmpegEncoderPool */
-FFmpegEncoderPool::FFmpegEncoderPool(const FFMPEG::H264Preset::type & preset, int vbitrate, xcb_window_t win, xcb_window_t composite, const QRect & region,
-    std::shared_ptr<XcbConnection> ptr, const std::string & format, bool cursor, bool focused, const AudioPlugin & audioPlugin, int audioBitrate, QObject* obj)
-    : QThread(obj), FFMPEG::H264Encoder(preset, vbitrate, audioPlugin, audioBitrate), windowId(win), compositeId(composite), windowRegion(region), xcb(ptr), shutdown(false), showCursor(cursor), startFocused(focused)
+FFmpegEncoderPool::FFmpegEncoderPool(const FFMPEG::H264Preset::type & preset, int vbitrate, xcb_window_t win, const QRect & region,
+    std::shared_ptr<XcbConnection> ptr, const std::string & format, bool cursor, bool focused, bool composite, bool damage, bool copyArea, bool sync, bool huge, int threads, int scale, const FFMPEG::VideoScaler::type & scaler, const AudioPlugin & audioPlugin, int audioBitrate, QObject* obj)
+    : QThread(obj), FFMPEG::H264Encoder(preset, vbitrate, audioPlugin, audioBitrate), windowId(win), windowRegion(region), xcb(ptr), shutdown(false), showCursor(cursor), startFocused(focused), useComposite(composite), useDamage(damage), useCopyArea(copyArea), frameSync(sync), hugePages(huge)
 {
+    video.hugePages = huge;
+    video.convertThreads = threads;
+    video.outputScale = scale;
+    video.scaler = scaler;
+
     time_t raw;
     std::time(& raw);
 
@@ -608,6 +710,8 @@ FFmpegEncoderPool::~FFmpegEncoderPool()
         terminate();
         wait();
     }
+
+    encodeFinish();
 }
 
 void FFmpegEncoderPool::run(void)
@@ -641,6 +745,10 @@ void FFmpegEncoderPool::run(void)
         }
     }
 
+    // segments reallocated on 2MB pages by the first capture
+    if(hugePages)
+        xcb->setHugePages(true);
+
     try
     {
         FFMPEG::H264Encoder::startRecord(outputPath.get(), windowRegion.width(), windowRegion.height());
@@ -653,6 +761,7 @@ void FFmpegEncoderPool::run(void)
         qWarning() << "stacktrace: " << err.trace.c_str();
 #endif
         emit errorNotify(str);
+        return;
     }
     catch(const std::runtime_error & err)
     {
@@ -661,6 +770,79 @@ void FFmpegEncoderPool::run(void)
         return;
     }
 
+    if(useDamage && ! xcb->damageStart(windowId))
+    {
+        qWarning() << "damage tracking failed, use full frames";
+        useDamage = false;
+    }
+
+    // geometry, liveness, focus and frame from events, no per frame round trips
+    // a window already gone is reported by the record loop
+    xcb->watchStart(windowId);
+
+    // root: nothing to redirect, captured directly
+    if(useComposite && windowId != xcb->getScreenRoot() && ! xcb->compositeStart(windowId))
+        qWarning() << "composite pixmap failed, capture the window";
+
+    if(useCopyArea && ! xcb->copyAreaStart(xcb->captureDrawable()))
+    {
+        qWarning() << "server copy failed, use shm get image";
+        useCopyArea = false;
+    }
+
+    // region of the full window follows its size, a part of it is kept while it fits
+    auto windowSize = xcb->windowState().size;
+    bool followWindow = windowRegion == QRect(QPoint(0, 0), windowSize);
+
+    if(showCursor && ! xcb->cursorStart())
+        qWarning() << "cursor notify failed, fetch cursor image per frame";
+
+    if(showCursor)
+        qDebug() << "cursor blend:" << CursorBlend::kernelName();
+
+    if(xcb->framebufferStart())
+        qDebug() << "xvfb framebuffer capture";
+
+    if(frameSync && ! xcb->frameSyncStart(windowId))
+    {
+        qWarning() << "frame sync failed, use timer";
+        frameSync = false;
+    }
+
+    // frame sync: constant rate slots, filled by a capture after repaint or by a repeat
+    auto syncStart = std::chrono::steady_clock::now();
+    int64_t syncSlot = -1;
+
+    QRect lastCursorRect;
+    uint32_t lastCursorSerial = 0;
+    // the cursor is blended into 32 bit frames only, the other layouts go without it
+    bool cursorOverlay = true;
+
+    // pixel layout of the captured frames, looked up again when their depth or visual changes
+    int layoutDepth = -1;
+    xcb_visualid_t layoutVisual = 0;
+    auto layout = ColorConvert::PixelLayout::Unknown;
+
+    // x requests and round trips per captured frame, logged every statsFrames
+    const size_t statsFrames = 300;
+    XcbFrameStats statsSum;
+    uint32_t statsMaxRequests = 0;
+    std::chrono::microseconds statsMaxWait{0};
+    size_t statsCount = 0;
+
+    xcb->statsStart();
+
+#ifdef BUILD_DEBUG
+    // capture cost per frame, compare the copy area and get image paths
+    std::chrono::microseconds captureTime{0};
+    size_t captureFrames = 0;
+#endif
+
+    // capture of the next frame overlaps encoding of the previous one
+    encodeStop = false;
+    encodeFailed = false;
+    encodeThread = std::thread(& FFmpegEncoderPool::encodeLoop, this);
+
     emit startedNotify(windowId);
 
     // record loop
@@ -679,10 +861,14 @@ void FFmpegEncoderPool::run(void)
             break;
         }
 
+        // randr screen changes, damage, window state
+        xcb->processEvents();
+        auto & state = xcb->windowState();
+
         if(windowId != xcb->getScreenRoot())
         {
             // window closed
-            if(! xcb->getWindowList().contains(windowId))
+            if(! state.alive)
             {
                 qWarning() << "xcb window not found" << windowId;
                 emit shutdownNotify();
@@ -690,97 +876,326 @@ void FFmpegEncoderPool::run(void)
             }
 
             // not active, paused
-            if(startFocused && windowId != xcb->getActiveWindow())
+            if(startFocused && windowId != state.active)
+            {
+                std::this_thread::sleep_for(durationMS);
                 continue;
+            }
         }
 
         now = std::chrono::steady_clock::now();
         auto timeMS = std::chrono::duration_cast<std::chrono::milliseconds>(now - point);
 
+        if(frameSync)
+        {
+            int64_t slot = (now - syncStart) / durationMS;
+
+            // fps limit: one capture per slot
+            if(slot > syncSlot && xcb->frameSyncTake())
+            {
+                // no repaint in the slots between
+                for(; syncSlot + 1 < slot; ++syncSlot)
+                    encodePush(nullptr);
+
+                syncSlot = slot;
+                timeMS = durationMS;
+            }
+            else
+            {
+                // slot passed without repaint, repeat
+                if(syncSlot + 1 < slot)
+                {
+                    encodePush(nullptr);
+                    ++syncSlot;
+                }
+
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(syncStart + durationMS * (slot + 1) - now);
+                xcb->waitEvents(wait.count() + 1);
+                continue;
+            }
+        }
+
         if(timeMS >= durationMS)
         {
             point = now;
 
-            if(windowId != xcb->getScreenRoot())
+            // window resized: the capture follows, the encoder fits the frames to its size
+            if(windowSize != state.size)
             {
-                // check window size changed
-                auto currentRegion = QRect(QPoint(0, 0), xcb->getWindowSize(windowId));
-                if(! currentRegion.contains(windowRegion))
+                auto currentRegion = QRect(QPoint(0, 0), state.size);
+
+                if(followWindow || ! currentRegion.contains(windowRegion))
                 {
-                    qWarning() << "window size changed";
-                    emit restartNotify();
-                    break;
+                    windowRegion = currentRegion;
+                    followWindow = true;
                 }
+
+                qDebug() << "window size changed:" << state.size << ", region:" << windowRegion;
+                windowSize = state.size;
             }
 
-            auto reply = xcb->getWindowRegion(compositeId ? compositeId : windowId, windowRegion);
-            if(! reply)
+            // resized to nothing, or unmapped: nothing to read, repeat the last frame
+            if(windowRegion.isEmpty() || ! xcb->captureReady())
             {
-                qWarning() << "xcb window region failed";
-                emit errorNotify("xcb window region failed");
-                break;
+                encodePush(nullptr);
+                continue;
             }
 
-            if(! reply->pixmapData() || 0 == reply->pixmapSize())
+            // composite pixmap renamed by the connection after a resize
+            auto drawable = xcb->captureDrawable();
+            XcbPendingRegionReply pending;
+#ifdef BUILD_DEBUG
+            auto captureStart = std::chrono::steady_clock::now();
+#endif
+
+            // issue the image request first, its round trip overlaps the cursor queries
+            if(! useDamage || xcb->damagePending(windowRegion))
+                pending = xcb->requestWindowRegion(drawable, windowRegion);
+
+            // cached cursor image, only the pointer position per frame
+            auto cursor = showCursor && cursorOverlay ? xcb->getCursorImage() : nullptr;
+            QRect cursorRect;
+
+            if(cursor)
             {
-                qWarning() << "empty image data";
-                emit errorNotify("empty image data");
-                break;
+                auto absRegion = QRect(state.position + windowRegion.topLeft(), windowRegion.size());
+                auto cursorAbs = QRect(xcb->getPointerPosition() - cursor->hotspot, cursor->size);
+
+                // partly visible cursor drawn clipped
+                if(absRegion.intersects(cursorAbs))
+                {
+                    auto & winFrame = state.frame;
+                    QPoint cursorPosition(cursorAbs.x() + winFrame.left, cursorAbs.y() + winFrame.top);
+                    cursorRect = QRect(cursorPosition - absRegion.topLeft(), cursorAbs.size());
+                }
             }
 
-            int bytesPerLine = reply->pixmapSize() / windowRegion.height();
-            auto xfixes = xcb->getXfixesExtension();
+            XcbPixmapInfoReply reply;
+
+            if(! pending && (cursorRect != lastCursorRect ||
+                                (cursor && cursor->serial != lastCursorSerial)))
+                pending = xcb->requestWindowRegion(drawable, windowRegion);
 
-            // sync cursor
-            if(showCursor && xfixes)
+            if(pending)
             {
-                QImage windowImage(reply->pixmapData(), windowRegion.width(), windowRegion.height(), bytesPerLine, QImage::Format_RGBX8888);
+                reply = xcb->completeWindowRegion(std::move(pending));
+                if(! reply)
+                {
+                    qWarning() << "xcb window region failed";
+                    emit errorNotify("xcb window region failed");
+                    break;
+                }
+
+#ifdef BUILD_DEBUG
+                captureTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - captureStart);
+                if(0 == ++captureFrames % 300)
+                {
+                    qDebug() << QString("capture %1: %2 frames, avg %3 us").arg(useCopyArea ? "copy area" : "get image")
+                                    .arg(captureFrames).arg(captureTime.count() / captureFrames);
+                }
+#endif
+
+                if(! reply->pixmapData() || 0 == reply->pixmapSize())
+                {
+                    qWarning() << "empty image data";
+                    emit errorNotify("empty image data");
+                    break;
+                }
 
-                if(auto cursorReply = xfixes->getCursorImageReply(xcb->connection()))
+                int bytesPerLine = reply->pixmapSize() / windowRegion.height();
+
+                if(reply->pixmapDepth() != layoutDepth || reply->pixmapVisual() != layoutVisual)
                 {
-                    auto absRegion = QRect(xcb->getWindowPosition(windowId) + windowRegion.topLeft(), windowRegion.size());
+                    layoutDepth = reply->pixmapDepth();
+                    layoutVisual = reply->pixmapVisual();
+                    layout = xcb->pixelLayout(layoutDepth, layoutVisual);
+
+                    if(ColorConvert::PixelLayout::Unknown == layout)
+                    {
+                        qWarning() << "unsupported pixel layout, depth:" << layoutDepth << ", visual:" << layoutVisual;
+                        emit errorNotify(QString("unsupported pixel layout, depth: %1").arg(layoutDepth));
+                        break;
+                    }
+
+                    cursorOverlay = ColorConvert::PixelLayout::BGRX32 == layout || ColorConvert::PixelLayout::RGBX32 == layout;
 
-                    if(absRegion.contains(QRect(cursorReply->x, cursorReply->y, cursorReply->width, cursorReply->height)))
+                    if(showCursor && ! cursorOverlay)
+                        qWarning() << "cursor overlay unsupported, pixel layout:" << ColorConvert::layoutName(layout);
+                }
+
+                // sync cursor
+                if(! cursorRect.isEmpty())
+                {
+                    // 32 bit frames only, the cursor is clipped to the region
+                    if(! cursorOverlay || bytesPerLine < windowRegion.width() * 4)
+                    {
+                        // nothing drawn: no damage, the tiles are unchanged
+                        cursorRect = QRect();
+                    }
+                    else
+                    if(ColorConvert::PixelLayout::BGRX32 == layout)
+                    {
+                        CursorBlend::blendBGRX(reply->pixmapData(), windowRegion.width(), windowRegion.height(), bytesPerLine,
+                                        cursor->pixels.data(), cursor->size.width(), cursor->size.height(), cursorRect.x(), cursorRect.y());
+                    }
+                    else
                     {
-                        uint32_t* ptr = xfixes->getCursorImageData(cursorReply);
-                        size_t len = xfixes->getCursorImageLength(cursorReply);
-
-                        if(ptr && 0 < len)
-                        {
-                            auto winFrame = windowId != xcb->getScreenRoot() ? xcb->getWindowFrame(windowId) : WinFrameSize{0,0,0,0};
-                            QImage cursorImage((uint8_t*) ptr, cursorReply->width, cursorReply->height, QImage::Format_RGBA8888);
-                            QPoint cursorPosition(cursorReply->x + winFrame.left, cursorReply->y + winFrame.top);
-                            QPainter painter(& windowImage);
-                            painter.drawImage(cursorPosition - absRegion.topLeft(), cursorImage);
-                        }
+                        CursorBlend::blendRGBX(reply->pixmapData(), windowRegion.width(), windowRegion.height(), bytesPerLine,
+                                        cursor->pixels.data(), cursor->size.width(), cursor->size.height(), cursorRect.x(), cursorRect.y());
                     }
+
+                    // the cursor is baked into the shm slot, refetch its area when the slot is reused
+                    if(useDamage && ! cursorRect.isEmpty())
+                        xcb->damageAdd(cursorRect.translated(windowRegion.topLeft()));
                 }
+
+                // the encoder converts the changed tiles only: the old and new cursor areas changed too
+                if(auto damage = reply->pixmapDamage())
+                    reply->setDamage(*damage + cursorRect + lastCursorRect);
+
+                lastCursorRect = cursorRect;
+                lastCursorSerial = cursor ? cursor->serial : 0;
             }
 
-            try
+            // empty reply: unchanged picture, repeat the last frame
+            encodePush(std::move(reply), windowRegion.size(), layout);
+
+            auto frameStats = xcb->statsTake();
+            statsSum.requests += frameStats.requests;
+            statsSum.bytesWritten += frameStats.bytesWritten;
+            statsSum.bytesRead += frameStats.bytesRead;
+            statsSum.calls += frameStats.calls;
+            statsMaxRequests = std::max(statsMaxRequests, frameStats.requests);
+            statsMaxWait = std::max(statsMaxWait, frameStats.calls.wait);
+
+            if(++statsCount == statsFrames)
             {
-                encodeFrame(reply->pixmapData(), bytesPerLine, windowRegion.height());
+                // counted requests per call site, all requests from the sequence numbers: the difference is uncounted
+                qDebug() << QString("xcb per frame: requests %1 (max %2, all %9), replies %3, blocked %4, wait %5 us (max %6), sent %7 B, received %8 B")
+                                .arg(statsSum.requests / double(statsCount), 0, 'f', 1).arg(statsMaxRequests)
+                                .arg(statsSum.calls.replies / double(statsCount), 0, 'f', 1)
+                                .arg(statsSum.calls.blocked / double(statsCount), 0, 'f', 1)
+                                .arg(statsSum.calls.wait.count() / statsCount).arg(statsMaxWait.count())
+                                .arg(statsSum.bytesWritten / statsCount).arg(statsSum.bytesRead / statsCount)
+                                .arg(xcb->statsSent() / double(statsCount), 0, 'f', 1);
+
+                for(auto & [site, st] : xcb->requestStats().callSites())
+                {
+                    qDebug() << QString("xcb call site: %1, requests %2, replies %3, blocked %4, wait %5 us")
+                                    .arg(site).arg(st.requests).arg(st.replies).arg(st.blocked).arg(st.wait.count());
+                }
+
+                xcb->statsReset();
+                statsSum = XcbFrameStats();
+                statsMaxRequests = 0;
+                statsMaxWait = std::chrono::microseconds(0);
+                statsCount = 0;
             }
-            catch(const FFMPEG::runtimeException & err)
+        }
+        else
+        {
+            std::this_thread::sleep_for(durationMS - timeMS);
+        }
+    }
+
+    encodeFinish();
+    xcb->statsStop();
+
+    if(useDamage)
+        xcb->damageStop();
+
+    if(useCopyArea)
+        xcb->copyAreaStop();
+
+    if(frameSync)
+        xcb->frameSyncStop();
+
+    xcb->framebufferStop();
+
+    xcb->cursorStop();
+    xcb->compositeStop();
+    xcb->watchStop();
+}
+
+void FFmpegEncoderPool::encodePush(XcbPixmapInfoReply pixmap, const QSize & size, const ColorConvert::PixelLayout & layout)
+{
+    std::unique_lock<std::mutex> guard(encodeLock);
+    encodeCond.wait(guard, [this]{ return encodeQueue.size() < encodeQueueMax || encodeFailed; });
+
+    encodeQueue.push_back(EncodeItem{ std::move(pixmap), size, layout });
+    guard.unlock();
+
+    encodeCond.notify_all();
+}
+
+void FFmpegEncoderPool::encodeFinish(void)
+{
+    if(encodeThread.joinable())
+    {
+        {
+            const std::lock_guard<std::mutex> guard(encodeLock);
+            encodeStop = true;
+        }
+
+        encodeCond.notify_all();
+        encodeThread.join();
+    }
+}
+
+void FFmpegEncoderPool::encodeLoop(void)
+{
+    while(true)
+    {
+        XcbPixmapInfoReply pixmap;
+        QSize size;
+        auto layout = ColorConvert::PixelLayout::Unknown;
+
+        {
+            std::unique_lock<std::mutex> guard(encodeLock);
+            encodeCond.wait(guard, [this]{ return encodeStop || ! encodeQueue.empty(); });
+
+            if(encodeQueue.empty())
+                break;
+
+            pixmap = std::move(encodeQueue.front().pixmap);
+            size = encodeQueue.front().size;
+            layout = encodeQueue.front().layout;
+            encodeQueue.pop_front();
+        }
+
+        encodeCond.notify_all();
+
+        // drain only, the shm slots return to the ring
+        if(encodeFailed)
+            continue;
+
+        try
+        {
+            if(pixmap)
             {
-                auto str = QString("%1 failed, code: %2, error: %3").arg(err.func).arg(err.code).arg(FFMPEG::errorString(err.code));
-                qWarning() << str;
+                setPixelLayout(layout);
+                encodeFrame(pixmap->pixmapData(), pixmap->pixmapSize() / size.height(), size.width(), size.height(), pixmap->pixmapDamage());
+            }
+            else
+                repeatFrame();
+        }
+        catch(const FFMPEG::runtimeException & err)
+        {
+            auto str = QString("%1 failed, code: %2, error: %3").arg(err.func).arg(err.code).arg(FFMPEG::errorString(err.code));
+            qWarning() << str;
 #ifdef BOOST_STACKTRACE_USE
-                qWarning() << "stacktrace: " << err.trace.c_str();
+            qWarning() << "stacktrace: " << err.trace.c_str();
 #endif
-                emit errorNotify(str);
-                shutdown = true;
-            }
-            catch(const std::runtime_error & err)
-            {
-                qWarning() << err.what();
-                emit errorNotify(err.what());
-                shutdown = true;
-            }
+            emit errorNotify(str);
+            encodeFailed = true;
+            shutdown = true;
         }
-        else
+        catch(const std::runtime_error & err)
         {
-            std::this_thread::sleep_for(durationMS - timeMS);
+            qWarning() << err.what();
+            emit errorNotify(err.what());
+            encodeFailed = true;
+            shutdown = true;
         }
     }
 }
@@ -23,7 +23,7 @@
 #ifndef MAIN_SETTINGS_H
 #define MAIN_SETTINGS_H
 
-#define VERSION 20260501
+#define VERSION 20261016
 
 #include <QList>
 #include <QObject>
@@ -36,11 +36,17 @@
 #include <QSystemTrayIcon>
 #include <QTreeWidgetItem>
 
+#include <list>
+#include <mutex>
 #include <atomic>
+#include <thread>
+#include <condition_variable>
 
 #include "ffmpegencoder.h"
 #include "xcbwrapper.h"
 
+Q_DECLARE_METATYPE(XcbWindowInfo)
+
 namespace Ui
 {
     class MainSettings;
@@ -52,17 +58,42 @@ class FFmpegEncoderPool : public QThread, public FFMPEG::H264Encoder
     Q_OBJECT
 
     xcb_window_t windowId;
-    xcb_pixmap_t compositeId;
     QRect windowRegion;
     std::shared_ptr<XcbConnection> xcb;
     std::atomic<bool> shutdown;
     std::unique_ptr<char[]> outputPath;
     bool showCursor;
     bool startFocused;
+    bool useComposite;
+    bool useDamage;
+    bool useCopyArea;
+    bool frameSync;
+    bool hugePages;
+
+    // encoder thread, owns the captured frames until encoded
+    std::thread encodeThread;
+    std::mutex encodeLock;
+    std::condition_variable encodeCond;
+    // captured frame, its size and pixel layout; no pixmap for a repeat
+    struct EncodeItem
+    {
+        XcbPixmapInfoReply pixmap;
+        QSize size;
+        ColorConvert::PixelLayout layout;
+    };
+
+    std::list<EncodeItem> encodeQueue;
+    std::atomic<bool> encodeFailed{false};
+    bool encodeStop = false;
+    const size_t encodeQueueMax = 2;
+
+    void encodeLoop(void);
+    void encodePush(XcbPixmapInfoReply, const QSize & = QSize(), const ColorConvert::PixelLayout & = ColorConvert::PixelLayout::Unknown);
+    void encodeFinish(void);
 
 public:
-    FFmpegEncoderPool(const FFMPEG::H264Preset::type &, int bitrate, xcb_window_t win, xcb_pixmap_t composite, const QRect &,
-            std::shared_ptr<XcbConnection>, const std::string &, bool, bool, const AudioPlugin &, int, QObject*);
+    FFmpegEncoderPool(const FFMPEG::H264Preset::type &, int bitrate, xcb_window_t win, const QRect &,
+            std::shared_ptr<XcbConnection>, const std::string &, bool, bool, bool, bool, bool, bool, bool, int, int, const FFMPEG::VideoScaler::type &, const AudioPlugin &, int, QObject*);
     ~FFmpegEncoderPool();
 
 protected:
@@ -70,7 +101,6 @@ protected:
 
 signals:
     void startedNotify(quint32);
-    void restartNotify(void);
     void shutdownNotify(void);
     void errorNotify(QString);
 };
@@ -94,7 +124,10 @@ class MainSettings : public QWidget
     QSize originalSize;
 
     xcb_window_t windowId = XCB_WINDOW_NONE;
-    xcb_pixmap_t compositeId = XCB_PIXMAP_NONE;
+
+    // window enumeration, off the gui thread
+    std::thread windowsThread;
+    std::atomic<bool> windowsBusy{false};
 
 public:
     explicit MainSettings(QWidget* parent = 0);
@@ -110,12 +143,12 @@ protected:
 
 private slots:
     void selectWindows(void);
+    void selectWindowsReady(const QList<XcbWindowInfo> &);
     void pushButton(void);
     bool startRecord(void);
     void startedRecord(quint32);
     void stopRecord(void);
     void stopRecord(QString);
-    void restartRecord(void);
     void iconActivated(QSystemTrayIcon::ActivationReason reason);
     void exitProgram(void);
     void updatePreviewLabel(quint32);
@@ -123,6 +156,7 @@ private slots:
 
 signals:
     void updatePreviewNotify(quint32);
+    void windowListNotify(const QList<XcbWindowInfo> &);
 };
 
 #endif // MAIN_SETTINGS_H
@@ -20,19 +20,27 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <array>
 #include <exception>
+#include <algorithm>
 
+#include <QDir>
+#include <QFile>
 #include <QDebug>
 
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "xcbwrapper.h"
 
-#define getReplyFunc1(NAME,conn,...) getReply1<NAME##_reply_t,NAME##_cookie_t>(NAME##_reply,conn,NAME(conn,##__VA_ARGS__))
-
 QString GenericError::toString(const char* func) const
 {
     auto err = get();
@@ -54,6 +62,72 @@ QString GenericError::toString(const char* func) const
     return nullptr;
 }
 
+/* Xcb RequestStats */
+thread_local XcbRequestStats* XcbRequestStats::bound = nullptr;
+
+XcbCallStats & XcbCallStats::operator+=(const XcbCallStats & st)
+{
+    requests += st.requests;
+    replies += st.replies;
+    blocked += st.blocked;
+    wait += st.wait;
+    return *this;
+}
+
+void* XcbRequestStats::waitForReply(xcb_connection_t* conn, unsigned int sequence, xcb_generic_error_t** error, const char* site)
+{
+    void* ptr = nullptr;
+
+    if(xcb_poll_for_reply(conn, sequence, & ptr, error))
+    {
+        if(bound)
+            bound->add(site, false, std::chrono::microseconds(0));
+
+        return ptr;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    ptr = xcb_wait_for_reply(conn, sequence, error);
+
+    if(bound)
+        bound->add(site, true, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+
+    return ptr;
+}
+
+void XcbRequestStats::add(const char* site, bool blocked, const std::chrono::microseconds & wait)
+{
+    auto it = std::find_if(sites.begin(), sites.end(), [=](auto & pair){ return pair.first == site; });
+
+    if(it == sites.end())
+        it = sites.emplace(sites.end(), site, XcbCallStats());
+
+    it->second.requests += 1;
+    it->second.replies += 1;
+    it->second.blocked += blocked ? 1 : 0;
+    it->second.wait += wait;
+}
+
+void XcbRequestStats::addRequests(const char* site, uint32_t count)
+{
+    auto it = std::find_if(sites.begin(), sites.end(), [=](auto & pair){ return pair.first == site; });
+
+    if(it == sites.end())
+        it = sites.emplace(sites.end(), site, XcbCallStats());
+
+    it->second.requests += count;
+}
+
+XcbCallStats XcbRequestStats::total(void) const
+{
+    XcbCallStats res;
+
+    for(auto & pair : sites)
+        res += pair.second;
+
+    return res;
+}
+
 /* Xcb Composite */
 XcbComposite::XcbComposite(xcb_connection_t* conn)
 {
@@ -65,7 +139,7 @@ XcbComposite::XcbComposite(xcb_connection_t* conn)
         throw xcb_error(__FUNCTION__);
     }
 
-    auto xcbReply = getReplyFunc1(xcb_composite_query_version, conn, XCB_COMPOSITE_MAJOR_VERSION, XCB_COMPOSITE_MINOR_VERSION);
+    auto xcbReply = getReplyFunc(xcb_composite_query_version, conn, XCB_COMPOSITE_MAJOR_VERSION, XCB_COMPOSITE_MINOR_VERSION);
 
     if(auto & err = xcbReply.error())
     {
@@ -139,6 +213,7 @@ bool XcbComposite::unredirectSubWindows(xcb_connection_t* conn, xcb_window_t win
 bool XcbComposite::nameWindowPixmap(xcb_connection_t* conn, xcb_window_t win, xcb_pixmap_t pix) const
 {
     auto cookie = xcb_composite_name_window_pixmap_checked(conn, win, pix);
+    XcbRequestStats::issued("xcb_composite_name_window_pixmap");
  
     if(auto err = GenericError(xcb_request_check(conn, cookie)))
     {
@@ -153,6 +228,7 @@ xcb_pixmap_t XcbComposite::nameWindowPixmap(xcb_connection_t* conn, xcb_window_t
 {
     xcb_pixmap_t pixmap = xcb_generate_id(conn);
     auto cookie = xcb_composite_name_window_pixmap_checked(conn, win, pixmap);
+    XcbRequestStats::issued("xcb_composite_name_window_pixmap");
  
     if(auto err = GenericError(xcb_request_check(conn, cookie)))
     {
@@ -165,7 +241,7 @@ xcb_pixmap_t XcbComposite::nameWindowPixmap(xcb_connection_t* conn, xcb_window_t
 
 xcb_window_t XcbComposite::getOverlayWindow(xcb_connection_t* conn, xcb_window_t win) const
 {
-    auto xcbReply = getReplyFunc1(xcb_composite_get_overlay_window, conn, win);
+    auto xcbReply = getReplyFunc(xcb_composite_get_overlay_window, conn, win);
 
     if(auto & err = xcbReply.error())
     {
@@ -202,7 +278,7 @@ XcbShm::XcbShm(xcb_connection_t* conn)
         throw xcb_error(__FUNCTION__);
     }
 
-    auto xcbReply = getReplyFunc1(xcb_shm_query_version, conn);
+    auto xcbReply = getReplyFunc(xcb_shm_query_version, conn);
 
     if(auto & err = xcbReply.error())
     {
@@ -212,7 +288,10 @@ XcbShm::XcbShm(xcb_connection_t* conn)
 
     if(auto & reply = xcbReply.reply())
     {
-        qDebug() << QString("shm version: %1.%2").arg((int) reply->major_version).arg((int) reply->minor_version);
+        versionMajor = reply->major_version;
+        versionMinor = reply->minor_version;
+        sharedPixmaps = reply->shared_pixmaps;
+        qDebug() << QString("shm version: %1.%2, shared pixmaps: %3").arg(versionMajor).arg(versionMinor).arg(sharedPixmaps);
     }
     else
     {
@@ -224,6 +303,7 @@ XcbShm::XcbShm(xcb_connection_t* conn)
 bool XcbShm::attach(xcb_connection_t* conn, xcb_shm_seg_t seg, uint32_t shmid, bool readOnly) const
 {
     auto cookie = xcb_shm_attach(conn, seg, shmid, readOnly);
+    XcbRequestStats::issued("xcb_shm_attach");
  
     if(auto err = GenericError(xcb_request_check(conn, cookie)))
     {
@@ -234,6 +314,21 @@ bool XcbShm::attach(xcb_connection_t* conn, xcb_shm_seg_t seg, uint32_t shmid, b
     return true;
 }
 
+bool XcbShm::attachFd(xcb_connection_t* conn, xcb_shm_seg_t seg, int fd, bool readOnly) const
+{
+    // libxcb takes the fd and closes it after send
+    auto cookie = xcb_shm_attach_fd_checked(conn, seg, fd, readOnly);
+    XcbRequestStats::issued("xcb_shm_attach_fd");
+
+    if(auto err = GenericError(xcb_request_check(conn, cookie)))
+    {
+        qWarning() << err.toString("xcb_shm_attach_fd");
+        return false;
+    }
+
+    return true;
+}
+
 bool XcbShm::detach(xcb_connection_t* conn, xcb_shm_seg_t seg) const
 {
     auto cookie = xcb_shm_detach_checked(conn, seg);
@@ -264,6 +359,7 @@ bool XcbShm::putImage(xcb_connection_t* conn, xcb_drawable_t drawable, xcb_gcont
 bool XcbShm::createPixmap(xcb_connection_t* conn, xcb_pixmap_t pid, xcb_drawable_t drawable, const QSize & sz, uint8_t depth, xcb_shm_seg_t shmseg, uint32_t offset) const
 {
     auto cookie = xcb_shm_create_pixmap_checked(conn, pid, drawable, sz.width(), sz.height(), depth, shmseg, offset);
+    XcbRequestStats::issued("xcb_shm_create_pixmap");
  
     if(auto err = GenericError(xcb_request_check(conn, cookie)))
     {
@@ -274,523 +370,2471 @@ bool XcbShm::createPixmap(xcb_connection_t* conn, xcb_pixmap_t pid, xcb_drawable
     return true;
 }
 
-/* Xcb Shm Pixmap */
-XcbShmPixmap::XcbShmPixmap(xcb_connection_t* conn, size_t sz) : XcbShm(conn)
+/* Xcb Buffer Pool */
+std::vector<uint8_t> XcbBufferPool::acquire(size_t sz)
 {
-    // init shm
-    shmid = shmget(IPC_PRIVATE, sz, IPC_CREAT | S_IRUSR | S_IWUSR);
+    std::vector<uint8_t> res;
 
-    if(shmid == -1)
     {
-        qWarning() << "shmget failed";
-        throw xcb_error(__FUNCTION__);
-    }
+        const std::lock_guard<std::mutex> guard(lock);
 
-    addr = reinterpret_cast<uint8_t*>(shmat(shmid, 0, 0));
-
-    // man shmat: check result
-    if(addr == reinterpret_cast<uint8_t*>(-1))
-    {
-        qWarning() << "shmat failed";
-        throw xcb_error(__FUNCTION__);
+        if(! spare.empty())
+        {
+            res.swap(spare.front());
+            spare.pop_front();
+        }
     }
 
-    shmseg = xcb_generate_id(conn);
-
-    if(! attach(conn, shmseg, shmid, false))
-        throw xcb_error(__FUNCTION__);
+    // reuse the capacity, allocates only while warming up
+    res.resize(sz);
+    return res;
 }
 
-XcbShmPixmap::~XcbShmPixmap()
+void XcbBufferPool::release(std::vector<uint8_t> && buf)
 {
-    if(addr)
-        shmdt(addr);
-    
-    if(0 <= shmid)
-        shmctl(shmid, IPC_RMID, 0);
+    const std::lock_guard<std::mutex> guard(lock);
+
+    if(spare.size() < 4)
+        spare.emplace_back(std::move(buf));
 }
 
-bool XcbShmPixmap::detach(xcb_connection_t* conn) const
+/* Pixmap Info Buffer */
+PixmapInfoBuffer::~PixmapInfoBuffer()
 {
-    return XcbShm::detach(conn, shmseg);
+    if(pool)
+        pool->release(std::move(buf));
 }
 
+/* Pixmap Info Shm */
+PixmapInfoShm::~PixmapInfoShm()
+{
+    if(owner)
+        owner->release(slot);
+}
 
-XcbShmGetImageReply XcbShmPixmap::getImageReply(xcb_connection_t* conn, xcb_drawable_t drawable, const QRect & reg, uint32_t offset)
+/* Xcb Shm Pixmap */
+XcbShmPixmap::XcbShmPixmap(xcb_connection_t* conn, size_t count) : XcbShm(conn), slots(count)
 {
-    auto xcbReply = getReplyFunc1(xcb_shm_get_image, conn, drawable, reg.x(), reg.y(), reg.width(), reg.height(),
-                                    0xFFFFFFFF, XCB_IMAGE_FORMAT_Z_PIXMAP, shmseg, offset);
-    if(auto & err = xcbReply.error())
+    // segments grow on demand, check the shm works with one page
+    if(! allocSlot(conn, slots.front(), pagesz))
     {
-        qWarning() << err.toString("xcb_shm_get_image");
-        return nullptr;
+        freeSlots();
+        throw xcb_error(__FUNCTION__);
     }
 
-    return std::move(xcbReply.first);
+    qDebug() << QString("shm ring: %1 slots, backend: %2").arg(slots.size()).arg(backendName(slots.front()));
 }
 
-XcbPixmapInfoReply XcbShmPixmap::getPixmap(const XcbShmGetImageReply & reply) const
+XcbShmPixmap::~XcbShmPixmap()
 {
-    return reply ? std::make_unique<PixmapInfoShm>(reply->depth, reply->visual, addr, reply->size) : nullptr;
+    freeSlots();
 }
 
-/* Xcb Xfixes */
-XcbXfixes::XcbXfixes(xcb_connection_t* conn)
+void XcbShmPixmap::setHugePages(bool enable)
 {
-    auto xfixes = xcb_get_extension_data(conn, &xcb_xfixes_id);
-    if(! xfixes || ! xfixes->present)
-    {
-        qWarning() << "xcb_xfixes failed";
-        throw xcb_error(__FUNCTION__);
-    }
-
-    auto xcbReply = getReplyFunc1(xcb_xfixes_query_version, conn, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+    // slots on 4k pages are reallocated by the next resize
+    hugePages = enable;
+}
 
-    if(auto & err = xcbReply.error())
-    {
-        qWarning() << err.toString("xcb_xfixes_query_version");
-        throw xcb_error(__FUNCTION__);
-    }
+const char* XcbShmPixmap::backendName(const XcbShmSlot & slot)
+{
+    if(slot.memfd)
+        return slot.huge ? "memfd hugetlb" : "memfd";
 
-    if(auto & reply = xcbReply.reply())
-    {
-        qDebug() << QString("xfixes version: %1.%2").arg((int) reply->major_version).arg((int) reply->minor_version);
-    }
-    else
-    {
-        qWarning() << "xcb_xfixes_query_version failed";
-        throw xcb_error(__FUNCTION__);
-    }
+    return slot.huge ? "sysv hugetlb" : "sysv";
 }
 
-XcbXfixesGetCursorImageReply XcbXfixes::getCursorImageReply(xcb_connection_t* conn) const
+bool XcbShmPixmap::allocSlot(xcb_connection_t* conn, XcbShmSlot & slot, size_t sz)
 {
-    auto xcbReply = getReplyFunc1(xcb_xfixes_get_cursor_image, conn);
+    bool allocated = false;
 
-    if(auto & err = xcbReply.error())
+    // hugetlb pool first, the size is rounded to the 2MB pages by resize
+    if(hugePages && 0 == sz % hugepagesz)
     {
-        qWarning() << err.toString("xcb_xfixes_get_cursor_image");
-        return nullptr;
+        allocated = (hasAttachFd() && allocSlotMemfd(conn, slot, sz, true)) ||
+                        allocSlotSysV(conn, slot, sz, true);
+
+        if(! allocated)
+        {
+            // no reserved hugepages (vm.nr_hugepages) or no rights, do not retry per frame
+            qWarning() << "shm hugepages unavailable, use 4k pages";
+            hugePages = false;
+        }
     }
 
-    return std::move(xcbReply.first);
-}
+    // memfd first: no shmmax/shmall limits, nothing left behind if killed
+    if(! allocated &&
+        ! (hasAttachFd() && allocSlotMemfd(conn, slot, sz, false)) &&
+        ! allocSlotSysV(conn, slot, sz, false))
+        return false;
 
-uint32_t* XcbXfixes::getCursorImageData(const XcbXfixesGetCursorImageReply & reply) const
-{
-    return xcb_xfixes_get_cursor_image_cursor_image(reply.get());
-}
+    slot.size = sz;
+    slot.region = QRect();
+    slot.dirty = QRegion();
 
-size_t XcbXfixes::getCursorImageLength(const XcbXfixesGetCursorImageReply & reply) const
-{
-    return xcb_xfixes_get_cursor_image_cursor_image_length(reply.get());
+    return true;
 }
 
-/* XcbConnection */
-XcbConnection::XcbConnection() :
-    conn{ xcb_connect(nullptr, nullptr), xcb_disconnect }, screen(nullptr), format(nullptr)
+bool XcbShmPixmap::allocSlotMemfd(xcb_connection_t* conn, XcbShmSlot & slot, size_t sz, bool huge)
 {
-    if(xcb_connection_has_error(conn.get()))
-        throw std::runtime_error("xcb connect");
-
-    auto setup = xcb_get_setup(conn.get());
-    if(! setup)
-        throw std::runtime_error("xcb init setup");
+    int fd = memfd_create("xcb-window-capture", MFD_CLOEXEC | MFD_ALLOW_SEALING | (huge ? MFD_HUGETLB : 0));
 
-    screen = xcb_setup_roots_iterator(setup).data;
-    if(! screen)
-        throw std::runtime_error("xcb init screen");
+    if(fd < 0)
+    {
+        if(huge)
+            qDebug() << "memfd_create hugetlb failed, error:" << strerror(errno);
+        else
+            qWarning() << "memfd_create failed, error:" << strerror(errno);
+        return false;
+    }
 
-    format = findFormat(screen->root_depth);
-    if(! format)
-        throw std::runtime_error("xcb init format");
+    // the server maps the same pages, forbid truncate under it
+    if(0 > ftruncate(fd, sz) || 0 > fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL))
+    {
+        qWarning() << "memfd setup failed, error:" << strerror(errno);
+        close(fd);
+        return false;
+    }
 
-    const int bpp = format->bits_per_pixel >> 3;
-    const int pagesz = 4096;
-    auto winsz = getWindowSize(screen->root);
-    const size_t shmsz = ((winsz.width() * winsz.height() * bpp / pagesz) + 1) * pagesz;
+    // hugetlb pages are reserved here, ENOMEM if the pool is short
+    auto ptr = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-    // shm
-    try
+    if(ptr == MAP_FAILED)
     {
-        shmpix = std::make_unique<XcbShmPixmap>(conn.get(), shmsz);
+        if(huge)
+            qDebug() << "mmap hugetlb failed, error:" << strerror(errno);
+        else
+            qWarning() << "mmap failed, error:" << strerror(errno);
+        close(fd);
+        return false;
     }
-    catch( const xcb_error &)
+
+    slot.addr = reinterpret_cast<uint8_t*>(ptr);
+    slot.memfd = true;
+    slot.huge = huge;
+    slot.size = sz;
+    slot.shmseg = xcb_generate_id(conn);
+
+    if(! attachFd(conn, slot.shmseg, fd, false))
     {
-        qWarning() << "shm pixmap init failed";
+        slot.shmseg = XCB_NONE;
+        freeSlot(slot);
+        return false;
     }
 
-    // composite
-    try
+    return true;
+}
+
+bool XcbShmPixmap::allocSlotSysV(xcb_connection_t* conn, XcbShmSlot & slot, size_t sz, bool huge)
+{
+    // init shm, SHM_HUGETLB needs CAP_IPC_LOCK or the vm.hugetlb_shm_group
+    slot.shmid = shmget(IPC_PRIVATE, sz, IPC_CREAT | S_IRUSR | S_IWUSR | (huge ? SHM_HUGETLB : 0));
+
+    if(slot.shmid == -1)
     {
-        composite = std::make_unique<XcbComposite>(conn.get());
+        if(huge)
+            qDebug() << "shmget hugetlb failed, size:" << sz << ", error:" << strerror(errno);
+        else
+            qWarning() << "shmget failed, size:" << sz;
+        return false;
     }
-    catch( const xcb_error &)
+
+    slot.addr = reinterpret_cast<uint8_t*>(shmat(slot.shmid, 0, 0));
+
+    // man shmat: check result
+    if(slot.addr == reinterpret_cast<uint8_t*>(-1))
     {
-        qWarning() << "composite init failed";
+        qWarning() << "shmat failed";
+        slot.addr = nullptr;
+        freeSlot(slot);
+        return false;
     }
 
-    // xfixes
-    try
+    slot.memfd = false;
+    slot.huge = huge;
+    slot.shmseg = xcb_generate_id(conn);
+
+    if(! attach(conn, slot.shmseg, slot.shmid, false))
     {
-        xfixes = std::make_unique<XcbXfixes>(conn.get());
+        slot.shmseg = XCB_NONE;
+        freeSlot(slot);
+        return false;
     }
-    catch( const xcb_error &)
+
+    // attached by both sides: the segment goes away with the last detach
+    shmctl(slot.shmid, IPC_RMID, 0);
+    slot.shmid = -1;
+
+    return true;
+}
+
+void XcbShmPixmap::freeSlot(XcbShmSlot & slot)
+{
+    if(slot.addr)
     {
-        qWarning() << "xfixes init failed";
+        if(slot.memfd)
+            munmap(slot.addr, slot.size);
+        else
+            shmdt(slot.addr);
     }
 
-    // event filter
-    const uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
-    xcb_change_window_attributes(conn.get(), screen->root, XCB_CW_EVENT_MASK, values);
+    if(0 <= slot.shmid)
+        shmctl(slot.shmid, IPC_RMID, 0);
 
-    xcb_flush(conn.get());
+    slot.addr = nullptr;
+    slot.shmid = -1;
+    slot.size = 0;
+    slot.memfd = false;
+    slot.huge = false;
 }
 
-XcbConnection::~XcbConnection()
+void XcbShmPixmap::freeSlots(void)
 {
-    if(shmpix)
-        shmpix->detach(conn.get());
+    for(auto & slot : slots)
+        freeSlot(slot);
 }
 
-xcb_window_t XcbConnection::getWindowParent(xcb_window_t win) const
+bool XcbShmPixmap::resizeSlot(xcb_connection_t* conn, XcbShmSlot & slot, size_t sz)
 {
-    if(screen->root != win)
-    {
-        auto xcbReply = getReplyFunc2(xcb_query_tree, conn.get(), win);
+    const size_t align = hugePages ? hugepagesz : pagesz;
+    sz = ((sz + align - 1) / align) * align;
 
-        if(auto & reply = xcbReply.reply())
-            return reply->parent;
+    // grow, or shrink a segment left from a much larger capture
+    // a 4k slot moves to hugepages once enabled
+    if(slot.addr && sz <= slot.size && slot.size <= sz * 4 && slot.huge == hugePages)
+        return true;
 
-        qWarning() << "xcb_query_tree failed";
-    }
-    return XCB_WINDOW_NONE;
-}
+    qDebug() << QString("shm slot resize: %1 -> %2").arg(slot.size).arg(sz);
 
-QPoint XcbConnection::translateCoordinates(xcb_window_t win, const QPoint & pos, xcb_window_t parent) const
-{
-    if(parent != XCB_WINDOW_NONE)
-    {
-        auto xcbReply = getReplyFunc2(xcb_translate_coordinates, conn.get(), win, parent, pos.x(), pos.y());
+    freeSlotPixmap(conn, slot);
 
-        if(auto & reply = xcbReply.reply())
-            return QPoint(reply->dst_x, reply->dst_y);
+    if(slot.shmseg != XCB_NONE)
+    {
+        XcbShm::detach(conn, slot.shmseg);
+        slot.shmseg = XCB_NONE;
     }
 
-    return pos;
+    freeSlot(slot);
+
+    if(! allocSlot(conn, slot, sz))
+        return false;
+
+    qDebug() << "shm slot backend:" << backendName(slot);
+    return true;
 }
 
-QRect XcbConnection::getWindowGeometry(xcb_window_t win, bool abspos) const
+bool XcbShmPixmap::detach(xcb_connection_t* conn) const
 {
-    auto xcbReply = getReplyFunc2(xcb_get_geometry, conn.get(), win);
+    bool res = true;
 
-    if(auto & reply = xcbReply.reply())
+    for(auto & slot : slots)
     {
-        // ref: https://xcb.freedesktop.org/windowcontextandmanipulation/
-        if(abspos)
+        if(slot.pixmap != XCB_PIXMAP_NONE)
         {
-            auto parent = getWindowParent(win);
-
-            if(parent == XCB_WINDOW_NONE)
-                return QRect(reply->x, reply->y, reply->width, reply->height);
-
-            auto geom = getWindowGeometry(parent, abspos);
-            return QRect(reply->x + geom.x(), reply->y + geom.y(), reply->width, reply->height);
+            xcb_free_pixmap(conn, slot.pixmap);
+            XcbRequestStats::issued("xcb_free_pixmap");
         }
 
-        return QRect(reply->x, reply->y, reply->width, reply->height);
+        if(slot.shmseg != XCB_NONE && ! XcbShm::detach(conn, slot.shmseg))
+            res = false;
     }
 
-    return QRect();
+    return res;
 }
 
-QPoint XcbConnection::getWindowPosition(xcb_window_t win, bool abspos) const
+void XcbShmPixmap::freeSlotPixmap(xcb_connection_t* conn, XcbShmSlot & slot) const
 {
-    return getWindowGeometry(win, abspos).topLeft();
+    if(slot.pixmap != XCB_PIXMAP_NONE)
+    {
+        xcb_free_pixmap(conn, slot.pixmap);
+        XcbRequestStats::issued("xcb_free_pixmap");
+    }
+
+    slot.pixmap = XCB_PIXMAP_NONE;
+    slot.pixmapSize = QSize();
+    slot.pixmapDepth = 0;
 }
 
-QSize XcbConnection::getWindowSize(xcb_window_t win) const
+bool XcbShmPixmap::slotPixmap(xcb_connection_t* conn, XcbShmSlot* slot, xcb_drawable_t drawable, const QSize & sz, int depth) const
 {
-    return getWindowGeometry(win).size();
+    if(slot->pixmap != XCB_PIXMAP_NONE && slot->pixmapSize == sz && slot->pixmapDepth == depth)
+        return true;
+
+    freeSlotPixmap(conn, *slot);
+
+    xcb_pixmap_t pixmap = xcb_generate_id(conn);
+
+    if(! createPixmap(conn, pixmap, drawable, sz, depth, slot->shmseg, 0))
+        return false;
+
+    slot->pixmap = pixmap;
+    slot->pixmapSize = sz;
+    slot->pixmapDepth = depth;
+
+    // pixmap content is not the last fetched region
+    slot->region = QRect();
+
+    return true;
 }
 
-QString XcbConnection::getAtomName(xcb_atom_t atom) const
+PixmapInfoShmReply XcbShmPixmap::acquire(xcb_connection_t* conn, size_t sz)
 {
-    auto xcbReply = getReplyFunc2(xcb_get_atom_name, conn.get(), atom);
+    XcbShmSlot* slot = nullptr;
 
-    if(auto & reply = xcbReply.reply())
     {
-        const char* name = xcb_get_atom_name_name(reply.get());
-        size_t len = xcb_get_atom_name_name_length(reply.get());
-        return QString(QByteArray(name, len));
+        std::unique_lock<std::mutex> guard(lock);
+
+        // wait the encoder returns a slot
+        cond.wait(guard, [this]{ return std::any_of(slots.begin(), slots.end(), [](auto & slot){ return ! slot.busy; }); });
+
+        for(size_t it = 0; it < slots.size(); ++it)
+        {
+            auto index = (next + it) % slots.size();
+
+            if(! slots[index].busy)
+            {
+                slot = & slots[index];
+                slot->busy = true;
+                next = (index + 1) % slots.size();
+                break;
+            }
+        }
     }
 
-    return QString("NONE");
+    auto info = std::make_unique<PixmapInfoShm>(this, slot);
+
+    // the slot is owned now, fit the segment to the capture outside the lock
+    if(! resizeSlot(conn, *slot, sz))
+        return nullptr;
+
+    return info;
 }
 
-xcb_format_t* XcbConnection::findFormat(int depth) const
+void XcbShmPixmap::release(XcbShmSlot* slot)
 {
-    auto setup = xcb_get_setup(conn.get());
-    if(! setup)
-        throw std::runtime_error("xcb_get_setup");
-
-    for(auto fIter = xcb_setup_pixmap_formats_iterator(setup); fIter.rem; xcb_format_next(& fIter))
     {
-        if(depth == fIter.data->depth)
-            return fIter.data;
+        const std::lock_guard<std::mutex> guard(lock);
+        slot->busy = false;
     }
 
-    return nullptr;
+    cond.notify_one();
 }
 
-int XcbConnection::bppFromDepth(int depth) const
+void XcbShmPixmap::markDirty(const QRegion & region)
 {
-    auto setup = xcb_get_setup(conn.get());
-    if(! setup)
-        throw std::runtime_error("xcb_get_setup");
-
-    for(auto fIter = xcb_setup_pixmap_formats_iterator(setup); fIter.rem; xcb_format_next(& fIter))
-        if(fIter.data->depth == depth) return fIter.data->bits_per_pixel;
+    const std::lock_guard<std::mutex> guard(lock);
 
-    return 0;
+    for(auto & slot : slots)
+        slot.dirty += region;
 }
 
-int XcbConnection::depthFromBPP(int bitsPerPixel) const
+xcb_shm_get_image_cookie_t XcbShmPixmap::requestImage(xcb_connection_t* conn, XcbShmSlot* slot, xcb_drawable_t drawable, const QRect & reg, uint32_t offset) const
+{
+    return xcb_shm_get_image(conn, drawable, reg.x(), reg.y(), reg.width(), reg.height(),
+                                    0xFFFFFFFF, XCB_IMAGE_FORMAT_Z_PIXMAP, slot->shmseg, offset);
+}
+
+XcbShmGetImageReply XcbShmPixmap::getImageReply(xcb_connection_t* conn, const xcb_shm_get_image_cookie_t & cookie) const
+{
+    xcb_generic_error_t* error = nullptr;
+
+    // usually ready: the round trip overlapped other frame work
+    auto ptr = XcbRequestStats::waitForReply(conn, cookie.sequence, & error, XcbRequest<xcb_shm_get_image_cookie_t>::name);
+    XcbShmGetImageReply reply(static_cast<xcb_shm_get_image_reply_t*>(ptr));
+
+    if(auto err = GenericError(error))
+    {
+        qWarning() << err.toString("xcb_shm_get_image");
+        return nullptr;
+    }
+
+    return reply;
+}
+
+XcbShmGetImageReply XcbShmPixmap::getImageReply(xcb_connection_t* conn, XcbShmSlot* slot, xcb_drawable_t drawable, const QRect & reg, uint32_t offset) const
+{
+    auto xcbReply = getReplyFunc(xcb_shm_get_image, conn, drawable, reg.x(), reg.y(), reg.width(), reg.height(),
+                                    0xFFFFFFFF, XCB_IMAGE_FORMAT_Z_PIXMAP, slot->shmseg, offset);
+    if(auto & err = xcbReply.error())
+    {
+        qWarning() << err.toString("xcb_shm_get_image");
+        return nullptr;
+    }
+
+    return std::move(xcbReply.first);
+}
+
+/* Xcb Framebuffer */
+XcbFramebuffer::XcbFramebuffer(const QString & path)
+{
+    int fd = open(path.toStdString().c_str(), O_RDONLY | O_CLOEXEC);
+    if(0 > fd)
+        throw std::runtime_error("xvfb framebuffer open");
+
+    struct stat st;
+    if(0 != fstat(fd, & st) || st.st_size < 100)
+    {
+        close(fd);
+        throw std::runtime_error("xvfb framebuffer stat");
+    }
+
+    size = st.st_size;
+    void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(ptr == MAP_FAILED)
+        throw std::runtime_error("xvfb framebuffer mmap");
+
+    addr = static_cast<uint8_t*>(ptr);
+
+    // XWDFileHeader: CARD32 fields, msb first
+    auto field = [this](int index)
+    {
+        auto ptr = addr + index * 4;
+        return (uint32_t(ptr[0]) << 24) | (uint32_t(ptr[1]) << 16) | (uint32_t(ptr[2]) << 8) | uint32_t(ptr[3]);
+    };
+
+    const uint32_t headerSize = field(0);
+    const uint32_t version = field(1);
+    const uint32_t format = field(2);
+    const uint32_t byteOrder = field(7);
+    const uint32_t ncolors = field(19);
+
+    depth = field(3);
+    screenSize = QSize(field(4), field(5));
+    bitsPerPixel = field(11);
+    pitch = field(12);
+
+    // XWDColor: 12 bytes
+    offset = headerSize + ncolors * 12;
+
+    // version 7, zpixmap, lsb first pixels
+    if(7 != version || XCB_IMAGE_FORMAT_Z_PIXMAP != format || XCB_IMAGE_ORDER_LSB_FIRST != byteOrder ||
+        (16 != bitsPerPixel && 32 != bitsPerPixel) || offset + pitch * screenSize.height() > size)
+    {
+        munmap(addr, size);
+        throw std::runtime_error("xvfb framebuffer format");
+    }
+
+    qDebug() << QString("xvfb framebuffer: %1, %2x%3, depth: %4, bpp: %5").arg(path)
+                    .arg(screenSize.width()).arg(screenSize.height()).arg(depth).arg(bitsPerPixel);
+}
+
+XcbFramebuffer::~XcbFramebuffer()
+{
+    if(addr)
+        munmap(addr, size);
+}
+
+QString XcbFramebuffer::findXvfbScreen(void)
+{
+    char* host = nullptr;
+    int display = 0;
+    int screen = 0;
+
+    // local display only
+    if(! xcb_parse_display(nullptr, & host, & display, & screen))
+        return nullptr;
+
+    bool local = ! host || ! host[0];
+    free(host);
+
+    if(! local)
+        return nullptr;
+
+    // the server command line: Xvfb :N ... -fbdir dir
+    for(auto & pid : QDir("/proc").entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+    {
+        if(! pid.at(0).isDigit())
+            continue;
+
+        QFile file(QString("/proc/%1/cmdline").arg(pid));
+        if(! file.open(QIODevice::ReadOnly))
+            continue;
+
+        auto args = file.readAll().split(0);
+        if(args.isEmpty() || ! args.front().endsWith("Xvfb"))
+            continue;
+
+        if(! args.contains(QString(":%1").arg(display).toUtf8()))
+            continue;
+
+        int index = args.indexOf("-fbdir");
+        if(0 <= index && index + 1 < args.size())
+            return QString("%1/Xvfb_screen%2").arg(QString(args.at(index + 1))).arg(screen);
+    }
+
+    return nullptr;
+}
+
+XcbPixmapInfoReply XcbFramebuffer::copyRegion(XcbBufferPool* pool, const QRect & reg, xcb_visualid_t visual) const
+{
+    if(! QRect(QPoint(0, 0), screenSize).contains(reg))
+        return nullptr;
+
+    const size_t bytesPerPixel = bitsPerPixel >> 3;
+    const size_t rowLength = reg.width() * bytesPerPixel;
+
+    auto info = std::make_unique<PixmapInfoBuffer>(pool, rowLength * reg.height());
+    info->setFormat(depth, visual);
+
+    auto dst = info->pixmapData();
+    auto src = addr + offset + reg.y() * pitch + reg.x() * bytesPerPixel;
+
+    // the server draws into the mapping, the frame is copied out
+    for(int row = 0; row < reg.height(); ++row)
+        std::copy_n(src + row * pitch, rowLength, dst + row * rowLength);
+
+    return info;
+}
+
+/* Xcb Pending Region */
+XcbPendingRegion::~XcbPendingRegion()
+{
+    // abandoned frame: drop the replies still in flight
+    for(auto & cookie : cookies)
+        xcb_discard_reply(conn, cookie.sequence);
+
+    for(auto & cookie : copies)
+        xcb_discard_reply(conn, cookie.sequence);
+
+    if(marker.sequence)
+        xcb_discard_reply(conn, marker.sequence);
+
+    XcbRequestStats::issued(XcbRequest<xcb_shm_get_image_cookie_t>::name, cookies.size());
+    XcbRequestStats::issued("copy area marker", marker.sequence ? 1 : 0);
+}
+
+/* Xcb Xfixes */
+XcbXfixes::XcbXfixes(xcb_connection_t* conn)
+{
+    auto xfixes = xcb_get_extension_data(conn, &xcb_xfixes_id);
+    if(! xfixes || ! xfixes->present)
+    {
+        qWarning() << "xcb_xfixes failed";
+        throw xcb_error(__FUNCTION__);
+    }
+
+    firstEvent = xfixes->first_event;
+
+    auto xcbReply = getReplyFunc(xcb_xfixes_query_version, conn, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+
+    if(auto & err = xcbReply.error())
+    {
+        qWarning() << err.toString("xcb_xfixes_query_version");
+        throw xcb_error(__FUNCTION__);
+    }
+
+    if(auto & reply = xcbReply.reply())
+    {
+        qDebug() << QString("xfixes version: %1.%2").arg((int) reply->major_version).arg((int) reply->minor_version);
+    }
+    else
+    {
+        qWarning() << "xcb_xfixes_query_version failed";
+        throw xcb_error(__FUNCTION__);
+    }
+}
+
+XcbXfixesGetCursorImageReply XcbXfixes::getCursorImageReply(xcb_connection_t* conn) const
+{
+    auto xcbReply = getReplyFunc(xcb_xfixes_get_cursor_image, conn);
+
+    if(auto & err = xcbReply.error())
+    {
+        qWarning() << err.toString("xcb_xfixes_get_cursor_image");
+        return nullptr;
+    }
+
+    return std::move(xcbReply.first);
+}
+
+uint32_t* XcbXfixes::getCursorImageData(const XcbXfixesGetCursorImageReply & reply) const
+{
+    return xcb_xfixes_get_cursor_image_cursor_image(reply.get());
+}
+
+size_t XcbXfixes::getCursorImageLength(const XcbXfixesGetCursorImageReply & reply) const
+{
+    return xcb_xfixes_get_cursor_image_cursor_image_length(reply.get());
+}
+
+bool XcbXfixes::selectCursorInput(xcb_connection_t* conn, xcb_window_t win, uint32_t mask) const
+{
+    auto cookie = xcb_xfixes_select_cursor_input_checked(conn, win, mask);
+
+    if(auto err = GenericError(xcb_request_check(conn, cookie)))
+    {
+        qWarning() << err.toString("xcb_xfixes_select_cursor_input");
+        return false;
+    }
+
+    return true;
+}
+
+const xcb_xfixes_cursor_notify_event_t* XcbXfixes::toCursorNotify(const xcb_generic_event_t* ev) const
+{
+    if(ev && (ev->response_type & ~0x80) == firstEvent + XCB_XFIXES_CURSOR_NOTIFY)
+        return reinterpret_cast<const xcb_xfixes_cursor_notify_event_t*>(ev);
+
+    return nullptr;
+}
+
+/* Xcb Damage */
+XcbDamage::XcbDamage(xcb_connection_t* conn)
+{
+    auto ext = xcb_get_extension_data(conn, &xcb_damage_id);
+    if(! ext || ! ext->present)
+    {
+        qWarning() << "xcb_damage failed";
+        throw xcb_error(__FUNCTION__);
+    }
+
+    firstEvent = ext->first_event;
+
+    auto xcbReply = getReplyFunc(xcb_damage_query_version, conn, XCB_DAMAGE_MAJOR_VERSION, XCB_DAMAGE_MINOR_VERSION);
+
+    if(auto & err = xcbReply.error())
+    {
+        qWarning() << err.toString("xcb_damage_query_version");
+        throw xcb_error(__FUNCTION__);
+    }
+
+    if(auto & reply = xcbReply.reply())
+    {
+        qDebug() << QString("damage version: %1.%2").arg((int) reply->major_version).arg((int) reply->minor_version);
+    }
+    else
+    {
+        qWarning() << "xcb_damage_query_version failed";
+        throw xcb_error(__FUNCTION__);
+    }
+}
+
+xcb_damage_damage_t XcbDamage::create(xcb_connection_t* conn, xcb_drawable_t drawable, uint8_t level) const
+{
+    xcb_damage_damage_t damage = xcb_generate_id(conn);
+    auto cookie = xcb_damage_create_checked(conn, damage, drawable, level);
+
+    if(auto err = GenericError(xcb_request_check(conn, cookie)))
+    {
+        qWarning() << err.toString("xcb_damage_create");
+        return XCB_NONE;
+    }
+
+    return damage;
+}
+
+bool XcbDamage::destroy(xcb_connection_t* conn, xcb_damage_damage_t damage) const
+{
+    auto cookie = xcb_damage_destroy_checked(conn, damage);
+
+    if(auto err = GenericError(xcb_request_check(conn, cookie)))
+    {
+        qWarning() << err.toString("xcb_damage_destroy");
+        return false;
+    }
+
+    return true;
+}
+
+void XcbDamage::subtract(xcb_connection_t* conn, xcb_damage_damage_t damage) const
+{
+    // capture hot path: unchecked, errors come through the event queue
+    xcb_damage_subtract(conn, damage, XCB_XFIXES_REGION_NONE, XCB_XFIXES_REGION_NONE);
+    XcbRequestStats::issued("xcb_damage_subtract");
+}
+
+const xcb_damage_notify_event_t* XcbDamage::toDamageNotify(const xcb_generic_event_t* ev) const
+{
+    if(ev && (ev->response_type & ~0x80) == firstEvent + XCB_DAMAGE_NOTIFY)
+        return reinterpret_cast<const xcb_damage_notify_event_t*>(ev);
+
+    return nullptr;
+}
+
+/* Xcb Present */
+XcbPresent::XcbPresent(xcb_connection_t* conn)
+{
+    auto ext = xcb_get_extension_data(conn, &xcb_present_id);
+    if(! ext || ! ext->present)
+    {
+        qWarning() << "xcb_present failed";
+        throw xcb_error(__FUNCTION__);
+    }
+
+    // present events come as generic events
+    majorOpcode = ext->major_opcode;
+
+    auto xcbReply = getReplyFunc(xcb_present_query_version, conn, XCB_PRESENT_MAJOR_VERSION, XCB_PRESENT_MINOR_VERSION);
+
+    if(auto & err = xcbReply.error())
+    {
+        qWarning() << err.toString("xcb_present_query_version");
+        throw xcb_error(__FUNCTION__);
+    }
+
+    if(auto & reply = xcbReply.reply())
+    {
+        qDebug() << QString("present version: %1.%2").arg((int) reply->major_version).arg((int) reply->minor_version);
+    }
+    else
+    {
+        qWarning() << "xcb_present_query_version failed";
+        throw xcb_error(__FUNCTION__);
+    }
+}
+
+bool XcbPresent::selectInput(xcb_connection_t* conn, uint32_t eid, xcb_window_t win, uint32_t mask) const
+{
+    auto cookie = xcb_present_select_input_checked(conn, eid, win, mask);
+
+    if(auto err = GenericError(xcb_request_check(conn, cookie)))
+    {
+        qWarning() << err.toString("xcb_present_select_input");
+        return false;
+    }
+
+    return true;
+}
+
+const xcb_present_complete_notify_event_t* XcbPresent::toCompleteNotify(const xcb_generic_event_t* ev) const
+{
+    if(ev && (ev->response_type & ~0x80) == XCB_GE_GENERIC)
+    {
+        auto ge = reinterpret_cast<const xcb_ge_generic_event_t*>(ev);
+
+        if(ge->extension == majorOpcode && ge->event_type == XCB_PRESENT_COMPLETE_NOTIFY)
+            return reinterpret_cast<const xcb_present_complete_notify_event_t*>(ev);
+    }
+
+    return nullptr;
+}
+
+/* Xcb Randr */
+XcbRandr::XcbRandr(xcb_connection_t* conn)
+{
+    auto ext = xcb_get_extension_data(conn, &xcb_randr_id);
+    if(! ext || ! ext->present)
+    {
+        qWarning() << "xcb_randr failed";
+        throw xcb_error(__FUNCTION__);
+    }
+
+    firstEvent = ext->first_event;
+
+    auto xcbReply = getReplyFunc(xcb_randr_query_version, conn, XCB_RANDR_MAJOR_VERSION, XCB_RANDR_MINOR_VERSION);
+
+    if(auto & err = xcbReply.error())
+    {
+        qWarning() << err.toString("xcb_randr_query_version");
+        throw xcb_error(__FUNCTION__);
+    }
+
+    if(auto & reply = xcbReply.reply())
+    {
+        qDebug() << QString("randr version: %1.%2").arg((int) reply->major_version).arg((int) reply->minor_version);
+    }
+    else
+    {
+        qWarning() << "xcb_randr_query_version failed";
+        throw xcb_error(__FUNCTION__);
+    }
+}
+
+bool XcbRandr::selectScreenChange(xcb_connection_t* conn, xcb_window_t win) const
+{
+    auto cookie = xcb_randr_select_input_checked(conn, win, XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE);
+
+    if(auto err = GenericError(xcb_request_check(conn, cookie)))
+    {
+        qWarning() << err.toString("xcb_randr_select_input");
+        return false;
+    }
+
+    return true;
+}
+
+QList<XcbOutputInfo> XcbRandr::getOutputList(xcb_connection_t* conn, xcb_window_t root) const
+{
+    QList<XcbOutputInfo> res;
+    auto xcbReply = getReplyFunc(xcb_randr_get_screen_resources_current, conn, root);
+
+    if(auto & err = xcbReply.error())
+    {
+        qWarning() << err.toString("xcb_randr_get_screen_resources_current");
+        return res;
+    }
+
+    auto & resources = xcbReply.reply();
+    if(! resources)
+        return res;
+
+    auto outputs = xcb_randr_get_screen_resources_current_outputs(resources.get());
+    int count = xcb_randr_get_screen_resources_current_outputs_length(resources.get());
+    auto timestamp = resources->config_timestamp;
+
+    std::vector<xcb_randr_get_output_info_cookie_t> outputCookies;
+    outputCookies.reserve(count);
+
+    // all outputs, then all crtcs: two round trips
+    for(int it = 0; it < count; ++it)
+        outputCookies.push_back(xcb_randr_get_output_info(conn, outputs[it], timestamp));
+
+    std::vector<std::pair<QString, xcb_randr_get_crtc_info_cookie_t>> crtcCookies;
+
+    for(auto & cookie : outputCookies)
+    {
+        auto xcbReply = getReply(conn, cookie);
+        auto & reply = xcbReply.reply();
+
+        if(auto & err = xcbReply.error())
+        {
+            qWarning() << err.toString("xcb_randr_get_output_info");
+            continue;
+        }
+
+        if(! reply || reply->crtc == XCB_NONE || reply->connection != XCB_RANDR_CONNECTION_CONNECTED)
+            continue;
+
+        auto name = QString::fromUtf8(reinterpret_cast<const char*>(xcb_randr_get_output_info_name(reply.get())),
+                                        xcb_randr_get_output_info_name_length(reply.get()));
+        crtcCookies.emplace_back(name, xcb_randr_get_crtc_info(conn, reply->crtc, timestamp));
+    }
+
+    for(auto & [name, cookie] : crtcCookies)
+    {
+        auto xcbReply = getReply(conn, cookie);
+        auto & reply = xcbReply.reply();
+
+        if(auto & err = xcbReply.error())
+        {
+            qWarning() << err.toString("xcb_randr_get_crtc_info");
+            continue;
+        }
+
+        if(reply && reply->width && reply->height)
+            res << XcbOutputInfo{ name, QRect(reply->x, reply->y, reply->width, reply->height) };
+    }
+
+    return res;
+}
+
+const xcb_randr_screen_change_notify_event_t* XcbRandr::toScreenChangeNotify(const xcb_generic_event_t* ev) const
+{
+    if(ev && (ev->response_type & ~0x80) == firstEvent + XCB_RANDR_SCREEN_CHANGE_NOTIFY)
+        return reinterpret_cast<const xcb_randr_screen_change_notify_event_t*>(ev);
+
+    return nullptr;
+}
+
+/* XcbConnection */
+XcbConnection::XcbConnection() :
+    conn{ xcb_connect(nullptr, nullptr), xcb_disconnect }, screen(nullptr), format(nullptr)
+{
+    if(xcb_connection_has_error(conn.get()))
+        throw std::runtime_error("xcb connect");
+
+    auto setup = xcb_get_setup(conn.get());
+    if(! setup)
+        throw std::runtime_error("xcb init setup");
+
+    screen = xcb_setup_roots_iterator(setup).data;
+    if(! screen)
+        throw std::runtime_error("xcb init screen");
+
+    format = findFormat(screen->root_depth);
+    if(! format)
+        throw std::runtime_error("xcb init format");
+
+    rootSize = QSize(screen->width_in_pixels, screen->height_in_pixels);
+
+    internAtoms({ "_NET_CLIENT_LIST", "_NET_ACTIVE_WINDOW", "_NET_FRAME_EXTENTS", "_NET_WM_NAME", "UTF8_STRING" });
+
+    // shm
+    try
+    {
+        shmpix = std::make_unique<XcbShmPixmap>(conn.get());
+    }
+    catch( const xcb_error &)
+    {
+        qWarning() << "shm pixmap init failed";
+    }
+
+    // composite
+    try
+    {
+        composite = std::make_unique<XcbComposite>(conn.get());
+    }
+    catch( const xcb_error &)
+    {
+        qWarning() << "composite init failed";
+    }
+
+    // xfixes
+    try
+    {
+        xfixes = std::make_unique<XcbXfixes>(conn.get());
+    }
+    catch( const xcb_error &)
+    {
+        qWarning() << "xfixes init failed";
+    }
+
+    // damage
+    try
+    {
+        damage = std::make_unique<XcbDamage>(conn.get());
+    }
+    catch( const xcb_error &)
+    {
+        qWarning() << "damage init failed";
+    }
+
+    // randr
+    try
+    {
+        randr = std::make_unique<XcbRandr>(conn.get());
+        randr->selectScreenChange(conn.get(), screen->root);
+    }
+    catch( const xcb_error &)
+    {
+        qWarning() << "randr init failed";
+    }
+
+    // present
+    try
+    {
+        present = std::make_unique<XcbPresent>(conn.get());
+    }
+    catch( const xcb_error &)
+    {
+        qWarning() << "present init failed";
+    }
+
+    // event filter
+    const uint32_t values[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+    xcb_change_window_attributes(conn.get(), screen->root, XCB_CW_EVENT_MASK, values);
+
+    xcb_flush(conn.get());
+}
+
+XcbConnection::~XcbConnection()
+{
+    statsStop();
+    compositeStop();
+    watchStop();
+    frameSyncStop();
+    cursorStop();
+    damageStop();
+    copyAreaStop();
+
+    if(shmpix)
+        shmpix->detach(conn.get());
+}
+
+xcb_window_t XcbConnection::getWindowParent(xcb_window_t win) const
+{
+    if(screen->root != win)
+    {
+        auto xcbReply = getReplyFunc(xcb_query_tree, conn.get(), win);
+
+        if(auto & reply = xcbReply.reply())
+            return reply->parent;
+
+        qWarning() << "xcb_query_tree failed";
+    }
+    return XCB_WINDOW_NONE;
+}
+
+QPoint XcbConnection::translateCoordinates(xcb_window_t win, const QPoint & pos, xcb_window_t parent) const
+{
+    if(parent != XCB_WINDOW_NONE)
+    {
+        auto xcbReply = getReplyFunc(xcb_translate_coordinates, conn.get(), win, parent, pos.x(), pos.y());
+
+        if(auto & reply = xcbReply.reply())
+            return QPoint(reply->dst_x, reply->dst_y);
+    }
+
+    return pos;
+}
+
+QRect XcbConnection::getWindowGeometry(xcb_window_t win, bool abspos) const
+{
+    if(abspos)
+    {
+        // ref: https://xcb.freedesktop.org/windowcontextandmanipulation/
+        // geometry and root position in one round trip, not one per parent
+        XcbRequestBatch batch(conn.get(), xcb_get_geometry(conn.get(), win),
+                                    xcb_translate_coordinates(conn.get(), win, screen->root, 0, 0));
+
+        auto geomReply = batch.reply<0>();
+        auto & geom = geomReply.reply();
+
+        if(! geom)
+            return QRect();
+
+        auto rootReply = batch.reply<1>();
+
+        if(auto & pos = rootReply.reply())
+        {
+            // translated is the inner origin, geometry counts from the border
+            return QRect(pos->dst_x - geom->border_width, pos->dst_y - geom->border_width, geom->width, geom->height);
+        }
+
+        return QRect(geom->x, geom->y, geom->width, geom->height);
+    }
+
+    auto xcbReply = getReplyFunc(xcb_get_geometry, conn.get(), win);
+
+    if(auto & reply = xcbReply.reply())
+        return QRect(reply->x, reply->y, reply->width, reply->height);
+
+    return QRect();
+}
+
+QPoint XcbConnection::getWindowPosition(xcb_window_t win, bool abspos) const
+{
+    return getWindowGeometry(win, abspos).topLeft();
+}
+
+QSize XcbConnection::getWindowSize(xcb_window_t win) const
+{
+    return getWindowGeometry(win).size();
+}
+
+QString XcbConnection::getAtomName(xcb_atom_t atom) const
+{
+    auto xcbReply = getReplyFunc(xcb_get_atom_name, conn.get(), atom);
+
+    if(auto & reply = xcbReply.reply())
+    {
+        const char* name = xcb_get_atom_name_name(reply.get());
+        size_t len = xcb_get_atom_name_name_length(reply.get());
+        return QString(QByteArray(name, len));
+    }
+
+    return QString("NONE");
+}
+
+xcb_format_t* XcbConnection::findFormat(int depth) const
+{
+    auto setup = xcb_get_setup(conn.get());
+    if(! setup)
+        throw std::runtime_error("xcb_get_setup");
+
+    for(auto fIter = xcb_setup_pixmap_formats_iterator(setup); fIter.rem; xcb_format_next(& fIter))
+    {
+        if(depth == fIter.data->depth)
+            return fIter.data;
+    }
+
+    return nullptr;
+}
+
+int XcbConnection::bppFromDepth(int depth) const
+{
+    auto setup = xcb_get_setup(conn.get());
+    if(! setup)
+        throw std::runtime_error("xcb_get_setup");
+
+    for(auto fIter = xcb_setup_pixmap_formats_iterator(setup); fIter.rem; xcb_format_next(& fIter))
+        if(fIter.data->depth == depth) return fIter.data->bits_per_pixel;
+
+    return 0;
+}
+
+int XcbConnection::depthFromBPP(int bitsPerPixel) const
 {
     auto setup = xcb_get_setup(conn.get());
     if(! setup)
         throw std::runtime_error("xcb_get_setup");
 
-    for(auto fIter = xcb_setup_pixmap_formats_iterator(setup); fIter.rem; xcb_format_next(& fIter))
-        if(fIter.data->bits_per_pixel == bitsPerPixel) return fIter.data->depth;
+    for(auto fIter = xcb_setup_pixmap_formats_iterator(setup); fIter.rem; xcb_format_next(& fIter))
+        if(fIter.data->bits_per_pixel == bitsPerPixel) return fIter.data->depth;
+
+    return 0;
+}
+
+xcb_visualtype_t* XcbConnection::findVisual(xcb_visualid_t vid) const
+{
+    for(auto dIter = xcb_screen_allowed_depths_iterator(screen); dIter.rem; xcb_depth_next(& dIter))
+    {
+        for(auto vIter = xcb_depth_visuals_iterator(dIter.data); vIter.rem; xcb_visualtype_next(& vIter))
+        {
+            if(vid == vIter.data->visual_id)
+                return vIter.data;
+        }
+    }
+
+    return nullptr;
+}
+
+xcb_window_t XcbConnection::getScreenRoot(void) const
+{
+    return screen->root;
+}
+
+QSize XcbConnection::getScreenSize(void) const
+{
+    return rootSize;
+}
+
+QList<XcbOutputInfo> XcbConnection::getOutputList(void) const
+{
+    return randr ? randr->getOutputList(conn.get(), screen->root) : QList<XcbOutputInfo>();
+}
+
+size_t XcbConnection::pixmapPitch(int width, int depth) const
+{
+    auto fmt = findFormat(depth);
+    if(! fmt)
+        fmt = format;
+
+    const int bpp = fmt->bits_per_pixel;
+    const int pad = fmt->scanline_pad;
+
+    return ((width * bpp + pad - 1) / pad) * pad / 8;
+}
+
+xcb_visualid_t XcbConnection::findVisualId(int depth) const
+{
+    if(depth == screen->root_depth)
+        return screen->root_visual;
+
+    for(auto dIter = xcb_screen_allowed_depths_iterator(screen); dIter.rem; xcb_depth_next(& dIter))
+    {
+        if(dIter.data->depth == depth)
+        {
+            auto vIter = xcb_depth_visuals_iterator(dIter.data);
+            if(vIter.rem)
+                return vIter.data->visual_id;
+        }
+    }
+
+    return 0;
+}
+
+ColorConvert::PixelLayout XcbConnection::pixelLayout(int depth, xcb_visualid_t vid) const
+{
+    // drawables without a known visual: the first one of the depth
+    auto visual = findVisual(vid ? vid : findVisualId(depth));
+
+    if(! visual || visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR)
+        return ColorConvert::PixelLayout::Unknown;
+
+    return ColorConvert::pixelLayout(bppFromDepth(depth), visual->red_mask, visual->green_mask, visual->blue_mask);
+}
+
+size_t XcbConnection::pixmapLength(const QSize & sz) const
+{
+    // composite pixmaps of argb windows can be deeper than root
+    const int bpp = std::max<int>(format->bits_per_pixel, 32);
+    const int pad = format->scanline_pad;
+    const size_t pitch = ((sz.width() * bpp + pad - 1) / pad) * pad / 8;
+
+    return pitch * sz.height();
+}
+
+/*
+xcb_screen_t* XcbConnection::getScreen(void) const
+{
+    return screen;
+}
+*/
+
+void XcbConnection::internAtoms(const QStringList & names)
+{
+    std::vector<xcb_intern_atom_cookie_t> cookies;
+    cookies.reserve(names.size());
+
+    // all requests in flight, one round trip
+    for(auto & name : names)
+    {
+        auto str = name.toStdString();
+        cookies.push_back(xcb_intern_atom(conn.get(), 0, str.size(), str.c_str()));
+    }
+
+    const std::lock_guard<std::mutex> guard(atomLock);
+
+    for(int it = 0; it < names.size(); ++it)
+    {
+        auto xcbReply = getReply(conn.get(), cookies[it]);
+
+        if(auto & err = xcbReply.error())
+            qWarning() << err.toString("xcb_intern_atom");
+        else
+        if(auto & reply = xcbReply.reply())
+            atoms.insert(names[it], reply->atom);
+    }
+}
+
+xcb_atom_t XcbConnection::getAtom(const QString & name, bool create) const
+{
+    {
+        const std::lock_guard<std::mutex> guard(atomLock);
+        auto it = atoms.find(name);
+
+        if(it != atoms.end())
+            return it.value();
+    }
+
+    auto xcbReply = getReplyFunc(xcb_intern_atom, conn.get(), create ? 0 : 1, name.length(), name.toStdString().c_str());
+
+    if(xcbReply.error())
+        return XCB_ATOM_NONE;
+
+    auto atom = xcbReply.reply() ? xcbReply.reply()->atom : (xcb_atom_t) XCB_ATOM_NONE;
+
+    // not existing atoms can be created later
+    if(atom != XCB_ATOM_NONE)
+    {
+        const std::lock_guard<std::mutex> guard(atomLock);
+        atoms.insert(name, atom);
+    }
+
+    return atom;
+}
+
+xcb_window_t XcbConnection::getActiveWindow(void) const
+{
+    auto xcbReply = getReplyFunc(xcb_get_property, conn.get(), false, screen->root,
+                        getAtom("_NET_ACTIVE_WINDOW"), XCB_ATOM_WINDOW, 0, 1);
+
+    if(xcbReply.error())
+        return XCB_WINDOW_NONE;
+
+    if(auto & reply = xcbReply.reply())
+    {
+        if(auto res = static_cast<xcb_window_t*>(xcb_get_property_value(reply.get())))
+            return *res;
+    }
+
+    return XCB_WINDOW_NONE;
+}
+
+XcbPropertyReply XcbConnection::getPropertyAnyType(xcb_window_t win, xcb_atom_t prop, uint32_t offset, uint32_t length) const
+{
+    auto xcbReply = getReplyFunc(xcb_get_property, conn.get(), false, win, prop, XCB_GET_PROPERTY_TYPE_ANY, offset, length);
+
+    if(auto & err = xcbReply.error())
+        qWarning() << err.toString("xcb_get_property");
+
+    return XcbPropertyReply(std::move(xcbReply.first));
+}
+
+xcb_atom_t XcbConnection::getPropertyType(xcb_window_t win, xcb_atom_t prop) const
+{
+    auto reply = getPropertyAnyType(win, prop, 0, 0);
+    return reply ? reply->type : (xcb_atom_t) XCB_ATOM_NONE;
+}
+
+// property value of the expected type, the type is checked on the reply instead of a separate request
+static QByteArray propertyBytes(XcbReplyError<xcb_get_property_cookie_t> && xcbReply, xcb_atom_t type)
+{
+    XcbPropertyReply reply(std::move(xcbReply.first));
+
+    // window gone meanwhile
+    if(xcbReply.error() || ! reply || reply->type != type)
+        return QByteArray();
+
+    return QByteArray(reinterpret_cast<const char*>(reply.value()), reply.length());
+}
+
+static QList<xcb_window_t> propertyWindows(XcbReplyError<xcb_get_property_cookie_t> && xcbReply)
+{
+    QList<xcb_window_t> res;
+    auto bytes = propertyBytes(std::move(xcbReply), XCB_ATOM_WINDOW);
+    auto wins = reinterpret_cast<const xcb_window_t*>(bytes.constData());
+
+    for(size_t it = 0; it < bytes.size() / sizeof(xcb_window_t); ++it)
+        res << wins[it];
+
+    return res;
+}
+
+QStringList XcbConnection::getPropertyStringList(xcb_window_t win, xcb_atom_t prop) const
+{
+    QStringList res;
+    auto bytes = propertyBytes(getReplyFunc(xcb_get_property, conn.get(), false, win, prop, XCB_ATOM_STRING, 0, 8192), XCB_ATOM_STRING);
+
+    if(bytes.size())
+    {
+        // remove last nul
+        if(bytes.endsWith('\0'))
+            bytes.chop(1);
+
+        for(auto & ba : bytes.split(0))
+            res << QString(ba);
+    }
+
+    return res;
+}
+
+QString XcbConnection::getWindowName(xcb_window_t win) const
+{
+    auto utf8 = getAtom("UTF8_STRING");
+    auto prop = getAtom("_NET_WM_NAME");
+
+    // both names in flight, the utf8 one used as fallback
+    XcbRequestBatch batch(conn.get(), xcb_get_property(conn.get(), false, win, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 0, 8192),
+                                    xcb_get_property(conn.get(), false, win, prop, utf8, 0, 8192));
+
+    QString res(propertyBytes(batch.reply<0>(), XCB_ATOM_STRING));
+
+    if(res.isEmpty())
+        res = QString::fromUtf8(propertyBytes(batch.reply<1>(), utf8));
+
+    return res;
+}
+
+QString XcbConnection::getPropertyString(xcb_window_t win, xcb_atom_t prop) const
+{
+    auto bytes = propertyBytes(getReplyFunc(xcb_get_property, conn.get(), false, win, prop, XCB_ATOM_STRING, 0, 8192), XCB_ATOM_STRING);
+    return bytes.size() ? QString(bytes) : nullptr;
+}
+
+QList<xcb_window_t> XcbConnection::getWindowList(void) const
+{
+    auto prop = getAtom("_NET_CLIENT_LIST");
+    return propertyWindows(getReplyFunc(xcb_get_property, conn.get(), false, screen->root, prop, XCB_ATOM_WINDOW, 0, 1024));
+}
+
+QList<XcbWindowInfo> XcbConnection::getWindowInfoList(void) const
+{
+    // tree, wm class, wm name, net wm name
+    typedef XcbRequestBatch<xcb_query_tree_cookie_t, xcb_get_property_cookie_t,
+                            xcb_get_property_cookie_t, xcb_get_property_cookie_t> InfoBatch;
+
+    auto wins = getWindowList();
+    auto utf8 = getAtom("UTF8_STRING");
+    auto netName = getAtom("_NET_WM_NAME");
+
+    std::vector<InfoBatch> batches;
+    batches.reserve(wins.size());
+
+    // all requests for all windows in flight, then collect
+    for(auto win : wins)
+    {
+        batches.emplace_back(conn.get(), xcb_query_tree(conn.get(), win),
+                            xcb_get_property(conn.get(), false, win, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 8192),
+                            xcb_get_property(conn.get(), false, win, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 0, 8192),
+                            xcb_get_property(conn.get(), false, win, netName, utf8, 0, 8192));
+    }
+
+    xcb_flush(conn.get());
+
+    QList<XcbWindowInfo> res;
+    res.reserve(wins.size());
+
+    for(int it = 0; it < wins.size(); ++it)
+    {
+        XcbWindowInfo info;
+        info.win = wins[it];
+
+        auto & batch = batches[it];
+        auto treeReply = batch.reply<0>();
+
+        if(auto & err = treeReply.error())
+            qWarning() << err.toString(batch.name<0>());
+        else
+        if(auto & tree = treeReply.reply())
+            info.parent = tree->parent;
+
+        auto wmClass = propertyBytes(batch.reply<1>(), XCB_ATOM_STRING);
+
+        if(wmClass.size())
+        {
+            if(wmClass.endsWith('\0'))
+                wmClass.chop(1);
+
+            for(auto & ba : wmClass.split(0))
+                info.wmClass << QString(ba);
+        }
+
+        info.name = QString(propertyBytes(batch.reply<2>(), XCB_ATOM_STRING));
+
+        if(info.name.isEmpty())
+            info.name = QString::fromUtf8(propertyBytes(batch.reply<3>(), utf8));
+
+        res << info;
+    }
+
+    return res;
+}
+
+WinFrameSize XcbConnection::getWindowFrame(xcb_window_t win) const
+{
+    WinFrameSize res;
+    auto prop = getAtom("_NET_FRAME_EXTENTS");
+
+    // left, right, top, bottom, CARDINAL[4]/32
+    if(auto reply = getPropertyAnyType(win, prop, 0, 16))
+    {
+        if(16 > reply.length())
+            throw std::runtime_error("_NET_FRAME_EXTENTS empty");
+
+        auto vals = reinterpret_cast<uint32_t*>(reply.value());
+        res.left = vals[0];
+        res.right = vals[1];
+        res.top = vals[2];
+        res.bottom = vals[3];
+    }
+
+    return res;
+}
+
+XcbPixmapInfoReply XcbConnection::getWindowRegion(xcb_window_t win, const QRect & reg, QString* errstr) const
+{
+    if(shmpix)
+    {
+        auto info = shmpix->acquire(conn.get(), pixmapLength(reg.size()));
+
+        if(! info)
+        {
+            if(errstr)
+                *errstr = "shm slot allocation failed";
+            return nullptr;
+        }
+
+        auto reply = shmpix->getImageReply(conn.get(), info->shmSlot(), win, reg);
+
+        if(! reply)
+        {
+            if(errstr)
+                *errstr = "xcb_shm_get_image failed";
+            return nullptr;
+        }
+
+        // full fetch, the slot is out of the damage tracking
+        info->shmSlot()->region = QRect();
+        info->setFormat(reply->depth, reply->visual, reply->size);
+
+        return info;
+    }
+
+    if(0 >= reg.width() || 0 >= reg.height())
+    {
+        auto msg = QString("incorrect size: %1 %2").arg(reg.width()).arg(reg.height());
+        qWarning() << msg;
+        if(errstr)
+            *errstr = msg;
+        return nullptr;
+    }
+
+    auto info = std::make_unique<PixmapInfoBuffer>(& bufpool, pixmapLength(reg.size()));
+    auto & pixels = info->pixels();
+
+    const uint32_t planeMask = 0xFFFFFFFF;
+    // max request length in 4 byte units, keep each reply within it
+    const size_t maxReqLength = xcb_get_maximum_request_length(conn.get()) * 4;
+    const int allowRows = std::clamp<size_t>(maxReqLength / pixmapLength(QSize(reg.width(), 1)), 1, reg.height());
+    const int bands = (reg.height() + allowRows - 1) / allowRows;
+
+    // all band requests in flight, collect in order
+    std::array<xcb_get_image_cookie_t, 64> cookies;
+    size_t pitch = 0;
+    int issued = 0;
+
+    for(int band = 0; band < bands; ++band)
+    {
+        for(; issued < bands && issued < band + (int) cookies.size(); ++issued)
+        {
+            int yy = reg.y() + issued * allowRows;
+            int rows = std::min(allowRows, reg.y() + reg.height() - yy);
+
+            cookies[issued % cookies.size()] = xcb_get_image(conn.get(), XCB_IMAGE_FORMAT_Z_PIXMAP, win, reg.x(), yy, reg.width(), rows, planeMask);
+        }
+
+        auto xcbReply = getReply(conn.get(), cookies[band % cookies.size()]);
+        auto & reply = xcbReply.reply();
+
+        if(auto & err = xcbReply.error())
+        {
+            auto msg = err.toString("xcb_get_image");
+            qWarning() << msg;
+            if(errstr)
+                *errstr = msg;
+        }
+
+        if(! reply)
+        {
+            for(int it = band + 1; it < issued; ++it)
+                xcb_discard_reply(conn.get(), cookies[it % cookies.size()].sequence);
+
+            XcbRequestStats::issued(XcbRequest<xcb_get_image_cookie_t>::name, issued - band - 1);
+            return nullptr;
+        }
+
+        auto length = xcb_get_image_data_length(reply.get());
+        auto data = xcb_get_image_data(reply.get());
+        int rows = std::min(allowRows, reg.height() - band * allowRows);
+
+        if(0 == pitch)
+        {
+            // real pitch of the drawable depth
+            pitch = length / rows;
+            pixels.resize(std::min(pixels.size(), pitch * reg.height()));
+            info->setFormat(reply->depth, reply->visual);
+        }
+
+        size_t offset = band * allowRows * pitch;
+
+        if(offset + length > pixels.size())
+        {
+            qWarning() << "xcb_get_image: unexpected length" << length;
+            length = pixels.size() - offset;
+        }
+
+        std::copy_n(data, length, pixels.data() + offset);
+    }
+
+    return info;
+}
+
+void XcbConnection::processEvents(void)
+{
+    while(auto ev = GenericEvent(xcb_poll_for_event(conn.get())))
+        processEvent(ev);
+
+    watchRefresh();
+
+    if(compositeDirty)
+        compositeRebind();
+}
+
+void XcbConnection::processEvent(GenericEvent & ev)
+{
+    if(0 == ev->response_type)
+    {
+        qWarning() << GenericError(reinterpret_cast<xcb_generic_error_t*>(ev.release())).toString("xcb event");
+        return;
+    }
+
+    if(randr)
+    {
+        if(auto notify = randr->toScreenChangeNotify(ev.get()))
+        {
+            bool rotated = notify->rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270);
+            rootSize = rotated ? QSize(notify->height, notify->width) : QSize(notify->width, notify->height);
+
+            outputsDirty = true;
+
+            qDebug() << "screen changed:" << rootSize;
+            return;
+        }
+    }
+
+    if(damage)
+    {
+        if(auto notify = damage->toDamageNotify(ev.get()))
+        {
+            if(notify->damage == damageId)
+                damageRegion += QRect(notify->area.x, notify->area.y, notify->area.width, notify->area.height);
+            else
+            // damage also comes mid repaint, a trigger only for windows without present
+            if(notify->damage == syncDamageId && ! syncPresented)
+                syncReady = true;
+            return;
+        }
+    }
+
+    if(present)
+    {
+        if(auto notify = present->toCompleteNotify(ev.get()))
+        {
+            if(std::any_of(syncEvents.begin(), syncEvents.end(), [&](auto & pair){ return pair.first == notify->event; }))
+                syncPresented = syncReady = true;
+            return;
+        }
+    }
+
+    if(xfixes)
+    {
+        if(auto notify = xfixes->toCursorNotify(ev.get()))
+        {
+            if(notify->cursor_serial != cursorImage.serial)
+                cursorDirty = true;
+            return;
+        }
+    }
+
+    switch(ev->response_type & ~0x80)
+    {
+        case XCB_CONFIGURE_NOTIFY:
+        {
+            auto notify = reinterpret_cast<xcb_configure_notify_event_t*>(ev.get());
+            if(notify->window == watch.win)
+            {
+                // resize allocates a new window pixmap, the named one keeps the old contents
+                if(compositeRedirected && watch.size != QSize(notify->width, notify->height))
+                    compositeDirty = true;
+
+                watch.size = QSize(notify->width, notify->height);
+            }
+            // the window or a frame moved
+            watch.positionDirty = true;
+            break;
+        }
+
+        case XCB_REPARENT_NOTIFY:
+            if(reinterpret_cast<xcb_reparent_notify_event_t*>(ev.get())->window == watch.win)
+                watch.parentsDirty = true;
+            break;
+
+        case XCB_MAP_NOTIFY:
+            if(reinterpret_cast<xcb_map_notify_event_t*>(ev.get())->window == watch.win)
+            {
+                // also a new pixmap after the unmap
+                if(compositeRedirected)
+                    compositeDirty = true;
+                watch.mapped = true;
+            }
+            break;
+
+        case XCB_UNMAP_NOTIFY:
+            if(reinterpret_cast<xcb_unmap_notify_event_t*>(ev.get())->window == watch.win)
+            {
+                watch.mapped = false;
+                watch.aliveDirty = true;
+            }
+            break;
+
+        case XCB_DESTROY_NOTIFY:
+            if(reinterpret_cast<xcb_destroy_notify_event_t*>(ev.get())->window == watch.win)
+            {
+                watch.alive = false;
+                watch.mapped = false;
+            }
+            break;
+
+        case XCB_PROPERTY_NOTIFY:
+        {
+            auto notify = reinterpret_cast<xcb_property_notify_event_t*>(ev.get());
+            if(notify->window == screen->root)
+            {
+                if(notify->atom == atomActiveWindow)
+                    watch.activeDirty = true;
+                else
+                if(notify->atom == atomClientList)
+                    watch.aliveDirty = true;
+            }
+            else
+            if(notify->window == watch.win && notify->atom == atomFrameExtents)
+                watch.frameDirty = true;
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+bool XcbConnection::watchStart(xcb_window_t win)
+{
+    watchStop();
+
+    atomActiveWindow = getAtom("_NET_ACTIVE_WINDOW");
+    atomClientList = getAtom("_NET_CLIENT_LIST");
+    atomFrameExtents = getAtom("_NET_FRAME_EXTENTS");
+
+    watch.win = win;
+    watch.activeDirty = true;
+
+    if(win == screen->root)
+    {
+        watch.alive = true;
+        watchRefresh();
+        return true;
+    }
+
+    // the geometry is read once, then follows the events
+    watch.size = getWindowSize(win);
+
+    watch.parentsDirty = true;
+    watch.positionDirty = true;
+    watch.frameDirty = true;
+    watch.aliveDirty = true;
+    watchRefresh();
+
+    return watch.alive;
+}
+
+void XcbConnection::watchStop(void)
+{
+    const uint32_t values[] = { XCB_EVENT_MASK_NO_EVENT };
+
+    for(auto win : watch.parents)
+        xcb_change_window_attributes(conn.get(), win, XCB_CW_EVENT_MASK, values);
+
+    if(! watch.parents.empty())
+        xcb_flush(conn.get());
+
+    watch = XcbWindowState();
+}
+
+bool XcbConnection::compositeStart(xcb_window_t win)
+{
+    compositeStop();
+
+    // set on success only: a composite window without its pixmap holds the capture back
+    if(! composite || win == screen->root)
+        return false;
+
+    if(! composite->redirectWindow(conn.get(), win))
+        return false;
+
+    compositeWin = win;
+    compositeRedirected = true;
+
+    if(! composite->redirectSubWindows(conn.get(), win))
+        qWarning() << "composite redirect subwindows failed";
+
+    compositePix = composite->nameWindowPixmap(conn.get(), win);
+
+    // no pixmap: undo the redirect, the window is captured directly
+    if(compositePix == XCB_PIXMAP_NONE)
+    {
+        compositeStop();
+        return false;
+    }
+
+    return true;
+}
+
+void XcbConnection::compositeStop(void)
+{
+    if(compositePix != XCB_PIXMAP_NONE)
+        xcb_free_pixmap(conn.get(), compositePix);
+
+    if(compositeRedirected)
+    {
+        composite->unredirectSubWindows(conn.get(), compositeWin);
+        composite->unredirectWindow(conn.get(), compositeWin);
+    }
+
+    compositeWin = XCB_WINDOW_NONE;
+    compositePix = XCB_PIXMAP_NONE;
+    compositeRedirected = false;
+    compositeDirty = false;
+}
+
+void XcbConnection::compositeRebind(void)
+{
+    compositeDirty = false;
+
+    if(compositePix != XCB_PIXMAP_NONE)
+    {
+        xcb_free_pixmap(conn.get(), compositePix);
+        XcbRequestStats::issued("xcb_free_pixmap");
+    }
+
+    // unmapped: no pixmap to name, the capture waits for the map notify
+    compositePix = watch.mapped ?
+        composite->nameWindowPixmap(conn.get(), compositeWin) : XCB_PIXMAP_NONE;
+
+    qDebug() << "composite pixmap rebind:" << compositePix << ", size:" << watch.size;
+}
+
+void XcbConnection::watchParents(void)
+{
+    const uint32_t none[] = { XCB_EVENT_MASK_NO_EVENT };
+
+    for(auto win : watch.parents)
+        xcb_change_window_attributes(conn.get(), win, XCB_CW_EVENT_MASK, none);
+
+    watch.parents.clear();
+
+    // the root keeps its property change mask, geometry there comes from randr
+    for(auto win = watch.win; win != XCB_WINDOW_NONE && win != screen->root; win = getWindowParent(win))
+        watch.parents.push_back(win);
+
+    for(auto win : watch.parents)
+    {
+        const uint32_t mask[] = { win == watch.win ?
+                                    uint32_t(XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE) : uint32_t(XCB_EVENT_MASK_STRUCTURE_NOTIFY) };
+        xcb_change_window_attributes(conn.get(), win, XCB_CW_EVENT_MASK, mask);
+    }
+
+    xcb_flush(conn.get());
+}
+
+void XcbConnection::watchRefresh(void)
+{
+    if(watch.win == XCB_WINDOW_NONE)
+        return;
+
+    if(watch.activeDirty)
+    {
+        watch.active = getActiveWindow();
+        watch.activeDirty = false;
+    }
+
+    if(watch.win == screen->root)
+    {
+        watch.size = rootSize;
+        return;
+    }
+
+    if(watch.parentsDirty)
+    {
+        watchParents();
+        watch.parentsDirty = false;
+        watch.positionDirty = true;
+    }
+
+    if(! watch.aliveDirty && ! watch.positionDirty && ! watch.frameDirty)
+        return;
+
+    // only the dirty state is asked for, all requests are sent before the first wait: one round trip
+    // the client list of a busy desktop is the largest reply, it is not fetched on a move
+    xcb_get_property_cookie_t listCookie = {};
+    xcb_get_geometry_cookie_t geomCookie = {};
+    xcb_translate_coordinates_cookie_t rootCookie = {};
+    xcb_get_property_cookie_t frameCookie = {};
+
+    if(watch.aliveDirty)
+        listCookie = xcb_get_property(conn.get(), false, screen->root, atomClientList, XCB_ATOM_WINDOW, 0, 1024);
+
+    if(watch.positionDirty)
+    {
+        geomCookie = xcb_get_geometry(conn.get(), watch.win);
+        rootCookie = xcb_translate_coordinates(conn.get(), watch.win, screen->root, 0, 0);
+    }
+
+    if(watch.frameDirty)
+        frameCookie = xcb_get_property(conn.get(), false, watch.win, atomFrameExtents, XCB_ATOM_CARDINAL, 0, 4);
+
+    if(watch.aliveDirty)
+    {
+        watch.alive = propertyWindows(getReply(conn.get(), listCookie)).contains(watch.win);
+        watch.aliveDirty = false;
+    }
+
+    if(watch.positionDirty)
+    {
+        auto geomReply = getReply(conn.get(), geomCookie);
+        auto rootReply = getReply(conn.get(), rootCookie);
+        auto & geom = geomReply.reply();
+        auto & pos = rootReply.reply();
+
+        watch.position = geom && pos ?
+            QPoint(pos->dst_x - geom->border_width, pos->dst_y - geom->border_width) : QPoint();
+        watch.positionDirty = false;
+    }
+
+    if(watch.frameDirty)
+    {
+        // left, right, top, bottom, CARDINAL[4]/32
+        auto bytes = propertyBytes(getReply(conn.get(), frameCookie), XCB_ATOM_CARDINAL);
+        watch.frame = WinFrameSize();
+
+        if(16 <= bytes.size())
+        {
+            auto vals = reinterpret_cast<const uint32_t*>(bytes.constData());
+            watch.frame = WinFrameSize{ vals[0], vals[1], vals[2], vals[3] };
+        }
+        else
+        if(bytes.size())
+        {
+            qWarning() << "_NET_FRAME_EXTENTS empty";
+        }
+
+        watch.frameDirty = false;
+    }
+}
+
+bool XcbConnection::waitEvents(int ms)
+{
+    // events read together with replies are queued already, poll(2) does not see them
+    if(auto ev = GenericEvent(xcb_poll_for_queued_event(conn.get())))
+    {
+        processEvent(ev);
+        processEvents();
+        return true;
+    }
+
+    // requests still in the output buffer would never bring the events waited for
+    xcb_flush(conn.get());
+
+    struct pollfd pfd = { xcb_get_file_descriptor(conn.get()), POLLIN, 0 };
 
-    return 0;
+    if(0 < poll(& pfd, 1, std::max(ms, 0)))
+    {
+        processEvents();
+        return true;
+    }
+
+    return false;
 }
 
-xcb_visualtype_t* XcbConnection::findVisual(xcb_visualid_t vid) const
+bool XcbConnection::framebufferStart(void)
 {
-    for(auto dIter = xcb_screen_allowed_depths_iterator(screen); dIter.rem; xcb_depth_next(& dIter))
+    // xvfb -fbdir: the /proc scan at the first capture start, not for every connection
+    if(! fbLookup)
     {
-        for(auto vIter = xcb_depth_visuals_iterator(dIter.data); vIter.rem; xcb_visualtype_next(& vIter))
+        fbLookup = true;
+
+        try
         {
-            if(vid == vIter.data->visual_id)
-                return vIter.data;
+            auto path = XcbFramebuffer::findXvfbScreen();
+
+            if(! path.isEmpty())
+                fbmap = std::make_unique<XcbFramebuffer>(path);
+        }
+        catch(const std::runtime_error & err)
+        {
+            qWarning() << "xvfb framebuffer init failed:" << err.what();
         }
     }
 
-    return nullptr;
+    // randr resize remaps the xvfb screen, the mapping is stale then
+    fbCapture = fbmap && fbmap->getScreenSize() == rootSize;
+    return fbCapture;
 }
 
-xcb_window_t XcbConnection::getScreenRoot(void) const
+void XcbConnection::framebufferStop(void)
 {
-    return screen->root;
+    fbCapture = false;
 }
 
-/*
-xcb_screen_t* XcbConnection::getScreen(void) const
+bool XcbConnection::frameSyncStart(xcb_window_t win)
 {
-    return screen;
+    frameSyncStop();
+
+    // present events are reported for the presenting window: the window and the client inside a frame
+    if(present)
+    {
+        std::vector<xcb_window_t> wins = { win };
+
+        if(win != screen->root)
+        {
+            auto xcbReply = getReplyFunc(xcb_query_tree, conn.get(), win);
+
+            if(auto & reply = xcbReply.reply())
+            {
+                auto childs = xcb_query_tree_children(reply.get());
+                wins.insert(wins.end(), childs, childs + xcb_query_tree_children_length(reply.get()));
+            }
+        }
+
+        for(auto child : wins)
+        {
+            uint32_t eid = xcb_generate_id(conn.get());
+
+            if(present->selectInput(conn.get(), eid, child))
+                syncEvents.emplace_back(eid, child);
+        }
+    }
+
+    if(damage)
+        syncDamageId = damage->create(conn.get(), win, XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+
+    // the first frame is captured at once
+    syncPresented = false;
+    syncReady = true;
+
+    return ! syncEvents.empty() || syncDamageId != XCB_NONE;
 }
-*/
 
-xcb_atom_t XcbConnection::getAtom(const QString & name, bool create) const
+void XcbConnection::frameSyncStop(void)
 {
-    auto xcbReply = getReplyFunc2(xcb_intern_atom, conn.get(), create ? 0 : 1, name.length(), name.toStdString().c_str());
+    // a select with no mask frees the event context
+    for(auto & [eid, win] : syncEvents)
+        xcb_present_select_input(conn.get(), eid, win, XCB_PRESENT_EVENT_MASK_NO_EVENT);
 
-    if(xcbReply.error())
-        return XCB_ATOM_NONE;
+    if(damage && syncDamageId != XCB_NONE)
+        damage->destroy(conn.get(), syncDamageId);
 
-    return xcbReply.reply() ? xcbReply.reply()->atom : (xcb_atom_t) XCB_ATOM_NONE;
+    syncEvents.clear();
+    syncDamageId = XCB_NONE;
+    syncPresented = false;
+    syncReady = false;
 }
 
-xcb_window_t XcbConnection::getActiveWindow(void) const
+bool XcbConnection::frameSyncTake(void)
 {
-    auto xcbReply = getReplyFunc2(xcb_get_property, conn.get(), false, screen->root,
-                        getAtom("_NET_ACTIVE_WINDOW"), XCB_ATOM_WINDOW, 0, 1);
+    if(! syncReady)
+        return false;
 
-    if(xcbReply.error())
-        return XCB_WINDOW_NONE;
+    syncReady = false;
 
-    if(auto & reply = xcbReply.reply())
+    // non empty level: the next repaint notifies again after subtract
+    if(syncDamageId != XCB_NONE)
     {
-        if(auto res = static_cast<xcb_window_t*>(xcb_get_property_value(reply.get())))
-            return *res;
+        damage->subtract(conn.get(), syncDamageId);
+        // no reply may follow before the wait: the server must see it now
+        xcb_flush(conn.get());
     }
 
-    return XCB_WINDOW_NONE;
+    return true;
 }
 
-XcbPropertyReply XcbConnection::getPropertyAnyType(xcb_window_t win, xcb_atom_t prop, uint32_t offset, uint32_t length) const
+bool XcbConnection::cursorStart(void)
 {
-    auto xcbReply = getReplyFunc2(xcb_get_property, conn.get(), false, win, prop, XCB_GET_PROPERTY_TYPE_ANY, offset, length);
+    cursorStop();
 
-    if(auto & err = xcbReply.error())
-        qWarning() << err.toString("xcb_get_property");
+    if(! xfixes || ! xfixes->selectCursorInput(conn.get(), screen->root))
+        return false;
 
-    return XcbPropertyReply(std::move(xcbReply.first));
+    cursorTracking = true;
+    cursorDirty = true;
+
+    return true;
 }
 
-xcb_atom_t XcbConnection::getPropertyType(xcb_window_t win, xcb_atom_t prop) const
+void XcbConnection::cursorStop(void)
 {
-    auto reply = getPropertyAnyType(win, prop, 0, 0);
-    return reply ? reply->type : (xcb_atom_t) XCB_ATOM_NONE;
+    if(cursorTracking)
+        xfixes->selectCursorInput(conn.get(), screen->root, 0);
+
+    cursorTracking = false;
+    cursorImage = XcbCursorImage();
 }
 
-QStringList XcbConnection::getPropertyStringList(xcb_window_t win, xcb_atom_t prop) const
+const XcbCursorImage* XcbConnection::getCursorImage(void)
 {
-    QStringList res;
+    if(! xfixes)
+        return nullptr;
 
-    if(XCB_ATOM_STRING == getPropertyType(win, prop))
+    // without notify, fetch every time
+    if(cursorDirty || ! cursorTracking)
     {
-        if(auto reply = getPropertyAnyType(win, prop, 0, 8192))
-        {
-            auto len = reply.length();
-            auto ptr = reinterpret_cast<const char*>(reply.value());
+        auto reply = xfixes->getCursorImageReply(conn.get());
 
-            for(auto & ba : QByteArray(ptr, len - (ptr[len - 1] ? 0 : 1 /* remove last nul */)).split(0))
-                res << QString(ba);
-        }
+        if(! reply)
+            return nullptr;
+
+        auto ptr = xfixes->getCursorImageData(reply);
+        auto len = xfixes->getCursorImageLength(reply);
+
+        cursorImage.serial = reply->cursor_serial;
+        cursorImage.size = QSize(reply->width, reply->height);
+        cursorImage.hotspot = QPoint(reply->xhot, reply->yhot);
+        cursorImage.pixels.assign(ptr, ptr + len);
+        cursorDirty = false;
     }
 
-    return res;
+    return cursorImage.pixels.empty() ? nullptr : & cursorImage;
 }
 
-QString XcbConnection::getWindowName(xcb_window_t win) const
+QPoint XcbConnection::getPointerPosition(void) const
 {
-    QString res = getPropertyString(win, XCB_ATOM_WM_NAME);
+    auto xcbReply = getReplyFunc(xcb_query_pointer, conn.get(), screen->root);
 
-    if(res.isEmpty())
-    {
-        auto utf8 = getAtom("UTF8_STRING");
-        auto prop = getAtom("_NET_WM_NAME");
-        auto type = getPropertyType(win, prop);
+    if(auto & reply = xcbReply.reply())
+        return QPoint(reply->root_x, reply->root_y);
 
-        if(type == utf8)
-        {
-            if(auto reply = getPropertyAnyType(win, prop, 0, 8192))
-            {
-                auto ptr = reinterpret_cast<const char*>(reply.value());
-                if(ptr) res.append(ptr);
-            }
-        }
-    }
+    return QPoint(-1, -1);
+}
 
-    return res;
+bool XcbConnection::damageStart(xcb_drawable_t drawable)
+{
+    damageStop();
+
+    if(damage)
+        damageId = damage->create(conn.get(), drawable);
+
+    damageLastRegion = QRect();
+    return damageId != XCB_NONE;
 }
 
-QString XcbConnection::getPropertyString(xcb_window_t win, xcb_atom_t prop) const
+void XcbConnection::damageStop(void)
 {
-    if(XCB_ATOM_STRING == getPropertyType(win, prop))
-    {
-        if(auto reply = getPropertyAnyType(win, prop, 0, 8192))
-        {
-            auto ptr = reinterpret_cast<const char*>(reply.value());
-            if(ptr) return QString(ptr);
-        }
-    }
+    if(damage && damageId != XCB_NONE)
+        damage->destroy(conn.get(), damageId);
 
-    return nullptr;
+    damageId = XCB_NONE;
+    damageRegion = QRegion();
 }
 
-QList<xcb_window_t> XcbConnection::getWindowList(void) const
+void XcbConnection::damageAdd(const QRect & rt)
 {
-    QList<xcb_window_t> res;
-    auto prop = getAtom("_NET_CLIENT_LIST");
+    // area overdrawn in the shm frames (cursor), refetch when a slot is reused
+    if(shmpix)
+        shmpix->markDirty(QRegion(rt));
+}
+
+void XcbConnection::takeDamage(XcbPendingRegion* pending) const
+{
+    // the same region captured before: only the damaged areas differ from it
+    pending->damageKnown = damageLastRegion == pending->region;
+
+    if(pending->damageKnown)
+        pending->damage = damageRegion.intersected(pending->region).translated(-pending->region.topLeft());
+}
+
+bool XcbConnection::damagePending(const QRect & reg)
+{
+    processEvents();
+
+    return damageLastRegion != reg || damageRegion.intersects(reg);
+}
+
+bool XcbConnection::copyAreaStart(xcb_drawable_t drawable)
+{
+    copyAreaStop();
+
+    if(! shmpix || ! shmpix->hasSharedPixmaps())
+        return false;
+
+    // the visual is the window's: the first one of the depth may order the channels otherwise
+    // a composite pixmap has the visual of its redirected window
+    const xcb_window_t win = drawable == compositePix ? compositeWin : drawable;
+
+    XcbRequestBatch batch(conn.get(), xcb_get_geometry(conn.get(), drawable),
+                            xcb_get_window_attributes(conn.get(), win));
+
+    auto xcbReply = batch.reply<0>();
+    auto xcbAttrs = batch.reply<1>();
+
+    if(auto & reply = xcbReply.reply())
+        copyDepth = reply->depth;
+
+    // not a window: the pixel layout falls back to the first visual of the depth
+    if(auto & reply = xcbAttrs.reply())
+        copyVisual = reply->visual;
+
+    return 0 < copyDepth;
+}
+
+void XcbConnection::copyAreaStop(void)
+{
+    if(copyGC != XCB_NONE)
+        xcb_free_gc(conn.get(), copyGC);
+
+    copyGC = XCB_NONE;
+    copyDepth = 0;
+    copyVisual = 0;
+}
+
+void XcbConnection::setHugePages(bool enable)
+{
+    if(shmpix)
+        shmpix->setHugePages(enable);
+}
+
+void XcbConnection::statsStart(void)
+{
+    statsReset();
+    stats.bind();
+}
+
+void XcbConnection::statsStop(void)
+{
+    stats.unbind();
+}
+
+void XcbConnection::statsReset(void)
+{
+    stats.clear();
+    statsCalls = XcbCallStats();
+    // the sequence of a no operation marks the requests sent so far, once per stats period
+    statsSequence = xcb_no_operation(conn.get()).sequence;
+    statsWritten = xcb_total_written(conn.get());
+    statsRead = xcb_total_read(conn.get());
+}
+
+XcbFrameStats XcbConnection::statsTake(void)
+{
+    XcbFrameStats res;
+
+    auto written = xcb_total_written(conn.get());
+    auto read = xcb_total_read(conn.get());
+    auto calls = stats.total();
+
+    // counted at the call sites: no marker request per frame
+    res.requests = calls.requests - statsCalls.requests;
+    res.bytesWritten = written - statsWritten;
+    res.bytesRead = read - statsRead;
+    res.calls.replies = calls.replies - statsCalls.replies;
+    res.calls.blocked = calls.blocked - statsCalls.blocked;
+    res.calls.wait = calls.wait - statsCalls.wait;
+
+    statsWritten = written;
+    statsRead = read;
+    statsCalls = calls;
+
+    return res;
+}
+
+uint32_t XcbConnection::statsSent(void)
+{
+    // all requests since the reset, the ones no call site counts included, without the no operation itself
+    return xcb_no_operation(conn.get()).sequence - statsSequence - 1;
+}
+
+XcbPendingRegionReply XcbConnection::requestWindowRegion(xcb_drawable_t drawable, const QRect & reg, QString* errstr)
+{
+    auto pending = std::make_unique<XcbPendingRegion>(conn.get(), reg);
+
+    // xvfb screen in memory: no request at all, the window region cropped at its root position
+    // partly off screen windows go the usual way
+    auto absRegion = reg.translated(watch.win == screen->root ? QPoint(0, 0) : watch.position);
 
-    if(XCB_ATOM_WINDOW == getPropertyType(screen->root, prop))
+    if(fbCapture && fbmap->getScreenSize() == rootSize &&
+        QRect(QPoint(0, 0), rootSize).contains(absRegion))
     {
-        if(auto reply = getPropertyAnyType(screen->root, prop, 0, 1024))
+        if(damageId != XCB_NONE)
         {
-            auto counts = reply.length() / sizeof(xcb_window_t);
-            auto wins = reinterpret_cast<xcb_window_t*>(reply.value());
+            processEvents();
+            takeDamage(pending.get());
 
-            for(uint32_t it = 0; it < counts; ++it)
-                res << wins[it];
+            if(! damageRegion.isEmpty())
+            {
+                if(shmpix)
+                    shmpix->markDirty(damageRegion);
+
+                damageRegion = QRegion();
+                damage->subtract(conn.get(), damageId);
+                // no request follows on this path: the subtract must reach the server, or the bounding box never resets
+                xcb_flush(conn.get());
+            }
         }
+
+        pending->pixmap = fbmap->copyRegion(& bufpool, absRegion, screen->root_visual);
+
+        if(! pending->pixmap && errstr)
+            *errstr = "xvfb framebuffer region failed";
+
+        damageLastRegion = reg;
+        return pending;
     }
 
-    return res;
-}
+    if(! shmpix)
+    {
+        pending->pixmap = getWindowRegion(drawable, reg, errstr);
+        return pending;
+    }
 
-WinFrameSize XcbConnection::getWindowFrame(xcb_window_t win) const
-{
-    WinFrameSize res;
-    auto prop = getAtom("_NET_FRAME_EXTENTS");
+    bool damaged = damageId != XCB_NONE;
 
-    // left, right, top, bottom, CARDINAL[4]/32
-    if(auto reply = getPropertyAnyType(win, prop, 0, 16))
+    if(damaged)
     {
-        if(16 > reply.length())
-            throw std::runtime_error("_NET_FRAME_EXTENTS empty");
+        processEvents();
+        takeDamage(pending.get());
 
-        auto vals = reinterpret_cast<uint32_t*>(reply.value());
-        res.left = vals[0];
-        res.right = vals[1];
-        res.top = vals[2];
-        res.bottom = vals[3];
+        // repair before fetch: damage after this point will come as new events
+        if(! damageRegion.isEmpty())
+        {
+            shmpix->markDirty(damageRegion);
+            damageRegion = QRegion();
+            damage->subtract(conn.get(), damageId);
+        }
     }
 
-    return res;
-}
+    pending->shm = shmpix->acquire(conn.get(), pixmapLength(reg.size()));
 
-XcbPixmapInfoReply XcbConnection::getWindowRegion(xcb_window_t win, const QRect & reg, QString* errstr) const
-{
-    if(shmpix)
+    if(! pending->shm)
     {
-        auto reply = shmpix->getImageReply(conn.get(), win, reg);
-        return shmpix->getPixmap(reply);
+        if(errstr)
+            *errstr = "shm slot allocation failed";
+        return nullptr;
     }
 
-    int pitch = reg.width() * (format->bits_per_pixel >> 2);
+    auto slot = pending->shm->shmSlot();
 
-    if(0 >= pitch || 0 >= reg.height())
+    if(copyDepth && ! shmpix->slotPixmap(conn.get(), slot, drawable, reg.size(), copyDepth))
     {
-        auto msg = QString("incorrect size: %1 %2").arg(reg.width()).arg(reg.height());
-        qWarning() << msg;
         if(errstr)
-            *errstr = msg;
+            *errstr = "shm pixmap create failed";
         return nullptr;
     }
 
-    XcbPixmapInfoReply res;
-    PixmapInfoBuffer* info = nullptr;
+    // no damage tracking, first frame in slot or region moved: full fetch
+    pending->full = ! damaged || slot->region != reg || 0 == damagePitch;
 
-    const uint32_t planeMask = 0xFFFFFFFF;
-    const uint32_t maxReqLength = xcb_get_maximum_request_length(conn.get());
-    uint32_t allowRows = qMin(maxReqLength / pitch, (uint32_t) reg.height());
+    QRegion dirty = pending->full ? QRegion(reg) : slot->dirty.intersected(reg);
 
-    for(int64_t yy = reg.y(); yy < reg.y() + reg.height(); yy += allowRows)
+    slot->region = damaged ? reg : QRect();
+    slot->dirty = QRegion();
+
+    // root: fetch the outputs as tiles, skip the areas no crtc shows
+    if(drawable == screen->root && randr)
     {
-        // last rows
-        if(yy + allowRows > reg.y() + reg.height())
-            allowRows = reg.y() + reg.height() - yy;
+        if(outputsDirty)
+        {
+            outputsRegion = QRegion();
 
-        auto xcbReply = getReplyFunc2(xcb_get_image, conn.get(), XCB_IMAGE_FORMAT_Z_PIXMAP, win, reg.x(), yy, reg.width(), allowRows, planeMask);
+            for(auto & output : getOutputList())
+                outputsRegion += output.geometry;
 
-        if(auto & err = xcbReply.error())
+            outputsDirty = false;
+        }
+
+        if(! outputsRegion.isEmpty())
         {
-            auto msg = err.toString("xcb_get_image");
-            qWarning() << msg;
-            if(errstr)
-                *errstr = msg;
-            break;
+            dirty &= outputsRegion;
+
+            if(pending->full && dirty != QRegion(reg))
+            {
+                // the root format is known without a reply
+                damageDepth = screen->root_depth;
+                damageVisual = screen->root_visual;
+                damagePitch = pixmapPitch(reg.width(), screen->root_depth);
+
+                if(slot->cleared != reg)
+                {
+                    std::fill_n(slot->addr, std::min(slot->size, damagePitch * reg.height()), 0);
+                    slot->cleared = reg;
+                }
+            }
         }
+    }
 
-        if(auto & reply = xcbReply.reply())
+    pending->single = pending->full && ! copyDepth && dirty == QRegion(reg);
+
+    if(copyDepth)
+    {
+        if(copyGC == XCB_NONE)
+        {
+            // the source may have children, no exposures for the unobscured copy
+            const uint32_t values[] = { XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS, 0 };
+            copyGC = xcb_generate_id(conn.get());
+            xcb_create_gc(conn.get(), copyGC, slot->pixmap, XCB_GC_SUBWINDOW_MODE | XCB_GC_GRAPHICS_EXPOSURES, values);
+            XcbRequestStats::issued("xcb_create_gc");
+        }
+
+        // copied by the server straight into the segment, exact rects
+        for(auto & rt : dirty)
+        {
+            pending->copies.push_back(xcb_copy_area_checked(conn.get(), drawable, slot->pixmap, copyGC,
+                                        rt.x(), rt.y(), rt.x() - reg.x(), rt.y() - reg.y(), rt.width(), rt.height()));
+        }
+
+        XcbRequestStats::issued("xcb_copy_area", pending->copies.size());
+
+        pending->marker = xcb_get_input_focus(conn.get());
+    }
+    else
+    if(pending->single)
+    {
+        pending->cookies.push_back(shmpix->requestImage(conn.get(), slot, drawable, reg));
+    }
+    else
+    {
+        // the shm frame has the region pitch, so fetch full width row bands in place
+        std::vector<std::pair<int, int>> bands;
+
+        for(auto & rt : dirty)
+            bands.emplace_back(rt.top(), rt.bottom() + 1);
+
+        std::sort(bands.begin(), bands.end());
+
+        if(! bands.empty())
         {
-            if(! res)
+            auto band = bands.begin();
+            for(auto it = std::next(band); it != bands.end(); ++it)
             {
-                info = new PixmapInfoBuffer(reply->depth, reply->visual, reg.height() * pitch);
-                res.reset(info);
+                if(it->first <= band->second)
+                    band->second = std::max(band->second, it->second);
+                else
+                    *(++band) = *it;
             }
 
-            auto length = xcb_get_image_data_length(reply.get());
-            auto data = xcb_get_image_data(reply.get());
-            auto & pixels = info->pixels();
+            bands.erase(std::next(band), bands.end());
+        }
 
-            pixels.insert(pixels.end(), data, data + length);
+        // all bands in flight at once
+        for(auto & [top, bottom] : bands)
+        {
+            auto rt = QRect(reg.x(), top, reg.width(), bottom - top);
+            pending->cookies.push_back(shmpix->requestImage(conn.get(), slot, drawable, rt, (top - reg.y()) * damagePitch));
         }
     }
 
-    return res;
+    xcb_flush(conn.get());
+    return pending;
+}
+
+XcbPixmapInfoReply XcbConnection::completeWindowRegion(XcbPendingRegionReply pending, QString* errstr)
+{
+    if(! pending)
+        return nullptr;
+
+    if(! pending->shm)
+    {
+        if(pending->pixmap && pending->damageKnown)
+            pending->pixmap->setDamage(pending->damage);
+
+        return std::move(pending->pixmap);
+    }
+
+    auto slot = pending->shm->shmSlot();
+    auto & reg = pending->region;
+    bool error = false;
+    XcbShmGetImageReply reply = nullptr;
+
+    if(pending->marker.sequence)
+    {
+        xcb_generic_error_t* err = nullptr;
+        auto ptr = XcbRequestStats::waitForReply(conn.get(), pending->marker.sequence, & err, "copy area marker");
+
+        pending->marker.sequence = 0;
+        GenericReply<xcb_get_input_focus_reply_t> marker(static_cast<xcb_get_input_focus_reply_t*>(ptr));
+
+        if(auto markerErr = GenericError(err))
+            qWarning() << markerErr.toString("xcb_get_input_focus");
+
+        // the marker reply is in: the copies are processed, checks do not block
+        while(! pending->copies.empty())
+        {
+            if(auto err = GenericError(xcb_request_check(conn.get(), pending->copies.front())))
+            {
+                qWarning() << err.toString("xcb_copy_area");
+                error = true;
+            }
+
+            pending->copies.pop_front();
+        }
+    }
+
+    while(! pending->cookies.empty())
+    {
+        auto res = shmpix->getImageReply(conn.get(), pending->cookies.front());
+        pending->cookies.pop_front();
+
+        if(! res)
+            error = true;
+        else
+        if(pending->single)
+            reply = std::move(res);
+    }
+
+    if(error || (pending->single && ! reply))
+    {
+        // try full fetch at next use
+        slot->region = QRect();
+
+        if(errstr)
+            *errstr = copyDepth ? "xcb_copy_area failed" : "xcb_shm_get_image failed";
+        return nullptr;
+    }
+
+    if(pending->full)
+    {
+        if(copyDepth)
+        {
+            damageDepth = copyDepth;
+            damageVisual = copyVisual;
+            damagePitch = pixmapPitch(reg.width(), copyDepth);
+        }
+        else
+        if(pending->single)
+        {
+            damageDepth = reply->depth;
+            damageVisual = reply->visual;
+            damagePitch = reply->size / reg.height();
+        }
+        // root tiles: the format is set with the requests
+    }
+
+    pending->shm->setFormat(damageDepth, damageVisual, damagePitch * reg.height());
+    damageLastRegion = reg;
+
+    if(pending->damageKnown)
+        pending->shm->setDamage(pending->damage);
+
+    return std::move(pending->shm);
 }
@@ -23,12 +23,22 @@
 #ifndef XCB_WRAPPER_H
 #define XCB_WRAPPER_H
 
+#include <list>
+#include <chrono>
+#include <tuple>
+#include <bitset>
+#include <utility>
+#include <mutex>
 #include <memory>
+#include <vector>
+#include <condition_variable>
 
 #include <QSize>
 #include <QPair>
 #include <QRect>
 #include <QList>
+#include <QHash>
+#include <QRegion>
 #include <QString>
 #include <QStringList>
 
@@ -36,6 +46,11 @@
 #include "xcb/shm.h"
 #include "xcb/xfixes.h"
 #include "xcb/composite.h"
+#include "xcb/damage.h"
+#include "xcb/randr.h"
+#include "xcb/present.h"
+
+#include "colorconvert.h"
 
 template<typename ReplyType>
 struct GenericReply : std::unique_ptr<ReplyType, void(*)(void*)>
@@ -64,14 +79,146 @@ struct ReplyError : std::pair<GenericReply<ReplyType>, GenericError>
     const GenericError & error(void) const { return std::pair<GenericReply<ReplyType>, GenericError>::second; }
 };
 
-template<typename Reply, typename Cookie>
-ReplyError<Reply> getReply1(std::function<Reply*(xcb_connection_t*, Cookie, xcb_generic_error_t**)> func, xcb_connection_t* conn, Cookie cookie)
+/// XcbRequest: reply type and reply function of a request, found by its cookie type
+template<typename Cookie>
+struct XcbRequest;
+
+#define XCB_REQUEST_DECLARE(NAME) \
+template<> \
+struct XcbRequest<NAME##_cookie_t> \
+{ \
+    typedef NAME##_reply_t reply_type; \
+    static constexpr const char* name = #NAME; \
+    static reply_type* reply(xcb_connection_t* conn, NAME##_cookie_t cookie, xcb_generic_error_t** err) { return NAME##_reply(conn, cookie, err); } \
+};
+
+XCB_REQUEST_DECLARE(xcb_get_geometry)
+XCB_REQUEST_DECLARE(xcb_get_window_attributes)
+XCB_REQUEST_DECLARE(xcb_query_tree)
+XCB_REQUEST_DECLARE(xcb_translate_coordinates)
+XCB_REQUEST_DECLARE(xcb_query_pointer)
+XCB_REQUEST_DECLARE(xcb_get_property)
+XCB_REQUEST_DECLARE(xcb_intern_atom)
+XCB_REQUEST_DECLARE(xcb_get_atom_name)
+XCB_REQUEST_DECLARE(xcb_get_image)
+XCB_REQUEST_DECLARE(xcb_get_input_focus)
+XCB_REQUEST_DECLARE(xcb_shm_query_version)
+XCB_REQUEST_DECLARE(xcb_shm_get_image)
+XCB_REQUEST_DECLARE(xcb_xfixes_query_version)
+XCB_REQUEST_DECLARE(xcb_xfixes_get_cursor_image)
+XCB_REQUEST_DECLARE(xcb_composite_query_version)
+XCB_REQUEST_DECLARE(xcb_composite_get_overlay_window)
+XCB_REQUEST_DECLARE(xcb_damage_query_version)
+XCB_REQUEST_DECLARE(xcb_randr_query_version)
+XCB_REQUEST_DECLARE(xcb_randr_get_screen_resources_current)
+XCB_REQUEST_DECLARE(xcb_randr_get_output_info)
+XCB_REQUEST_DECLARE(xcb_randr_get_crtc_info)
+XCB_REQUEST_DECLARE(xcb_present_query_version)
+
+/// XcbCallStats
+struct XcbCallStats
+{
+    // requests issued, void ones and replies discarded included
+    uint32_t requests = 0;
+    uint32_t replies = 0;
+    // replies not there yet when asked for
+    uint32_t blocked = 0;
+    std::chrono::microseconds wait{0};
+
+    XcbCallStats & operator+=(const XcbCallStats &);
+};
+
+/// XcbRequestStats: request and reply counters per call site, collected on the thread the stats are bound to
+class XcbRequestStats
+{
+    static thread_local XcbRequestStats* bound;
+
+    // few call sites, keyed by their literal name
+    std::vector<std::pair<const char*, XcbCallStats>> sites;
+
+public:
+    static XcbRequestStats* current(void) { return bound; }
+    static void* waitForReply(xcb_connection_t*, unsigned int sequence, xcb_generic_error_t**, const char* site);
+    // requests without a reply waited for: void requests and discarded replies
+    static void issued(const char* site, uint32_t count = 1) { if(bound && count) bound->addRequests(site, count); }
+
+    void bind(void) { bound = this; }
+    void unbind(void) { if(bound == this) bound = nullptr; }
+
+    void add(const char* site, bool blocked, const std::chrono::microseconds &);
+    void addRequests(const char* site, uint32_t count);
+    void clear(void) { sites.clear(); }
+
+    XcbCallStats total(void) const;
+    const std::vector<std::pair<const char*, XcbCallStats>> & callSites(void) const { return sites; }
+};
+
+template<typename Cookie>
+using XcbReplyError = ReplyError<typename XcbRequest<Cookie>::reply_type>;
+
+/// getReply: blocks on one reply, the reply function is resolved at compile time
+template<typename Cookie>
+XcbReplyError<Cookie> getReply(xcb_connection_t* conn, const Cookie & cookie)
 {
+    typedef typename XcbRequest<Cookie>::reply_type Reply;
     xcb_generic_error_t* error = nullptr;
-    Reply* reply = func(conn, cookie, & error);
-    return ReplyError<Reply>(reply, error);
+
+    // counted on the capture thread only
+    if(XcbRequestStats::current())
+    {
+        auto reply = XcbRequestStats::waitForReply(conn, cookie.sequence, & error, XcbRequest<Cookie>::name);
+        return XcbReplyError<Cookie>(static_cast<Reply*>(reply), error);
+    }
+
+    auto reply = XcbRequest<Cookie>::reply(conn, cookie, & error);
+    return XcbReplyError<Cookie>(reply, error);
 }
 
+#define getReplyFunc(NAME,conn,...) getReply(conn,NAME(conn,##__VA_ARGS__))
+
+/// XcbRequestBatch: requests of mixed types in flight together, replies collected by index
+template<typename... Cookies>
+class XcbRequestBatch
+{
+    xcb_connection_t* conn = nullptr;
+    std::tuple<Cookies...> cookies;
+    std::bitset<sizeof...(Cookies)> collected;
+
+    template<size_t... Index>
+    void discard(std::index_sequence<Index...>)
+    {
+        // replies not asked for are dropped by xcb on arrival
+        ((collected.test(Index) ? void() : (xcb_discard_reply(conn, std::get<Index>(cookies).sequence), XcbRequestStats::issued(name<Index>()))), ...);
+    }
+
+public:
+    XcbRequestBatch(xcb_connection_t* ptr, Cookies... args) : conn(ptr), cookies(args...) {}
+    ~XcbRequestBatch() { if(conn) discard(std::index_sequence_for<Cookies...>()); }
+
+    XcbRequestBatch(const XcbRequestBatch &) = delete;
+    XcbRequestBatch & operator=(const XcbRequestBatch &) = delete;
+
+    XcbRequestBatch(XcbRequestBatch && other) noexcept
+        : conn(other.conn), cookies(other.cookies), collected(other.collected) { other.conn = nullptr; }
+
+    /// send the queued requests without waiting, replies arrive while the caller works
+    void flush(void) const { xcb_flush(conn); }
+
+    template<size_t Index>
+    const char* name(void) const
+    {
+        return XcbRequest<std::tuple_element_t<Index, std::tuple<Cookies...>>>::name;
+    }
+
+    /// blocks on the reply of one request, each one is collected once
+    template<size_t Index>
+    auto reply(void)
+    {
+        collected.set(Index);
+        return getReply(conn, std::get<Index>(cookies));
+    }
+};
+
 /// XcbPropertyReply
 struct XcbPropertyReply : GenericReply<xcb_get_property_reply_t>
 {
@@ -89,6 +236,10 @@ protected:
     int depth = 0;
     xcb_visualid_t visual = 0;
 
+    // changed since the previous capture, relative to the region; unknown without damage tracking
+    QRegion damage;
+    bool damageKnown = false;
+
 public:
     XcbPixmapInfo() = default;
     virtual ~XcbPixmapInfo() = default;
@@ -98,6 +249,9 @@ public:
     int pixmapDepth(void) const { return depth; }
     const xcb_visualid_t & pixmapVisual(void) const { return visual; }
 
+    void setDamage(const QRegion & reg) { damage = reg; damageKnown = true; }
+    const QRegion* pixmapDamage(void) const { return damageKnown ? & damage : nullptr; }
+
     virtual const uint8_t* pixmapData(void) const = 0;
     virtual uint8_t* pixmapData(void) = 0;
     virtual size_t pixmapSize(void) const = 0;
@@ -111,11 +265,25 @@ struct xcb_error : public std::runtime_error
     explicit xcb_error( const std::string_view err ) : std::runtime_error( err.data() ) {}
 };
 
+/// XcbBufferPool
+class XcbBufferPool
+{
+    std::mutex lock;
+    std::list<std::vector<uint8_t>> spare;
+
+public:
+    XcbBufferPool() = default;
+
+    std::vector<uint8_t> acquire(size_t);
+    void release(std::vector<uint8_t> &&);
+};
+
 /// PixmapInfoBuffer
 class PixmapInfoBuffer : public XcbPixmapInfo
 {
 protected:
     std::vector<uint8_t> buf;
+    XcbBufferPool* pool = nullptr;
 
 public:
     PixmapInfoBuffer() = default;
@@ -123,6 +291,13 @@ public:
     PixmapInfoBuffer(int depth, xcb_visualid_t visual, size_t res = 0)
         : XcbPixmapInfo(depth, visual) { buf.reserve(res); }
 
+    PixmapInfoBuffer(XcbBufferPool* ptr, size_t sz)
+        : buf(ptr->acquire(sz)), pool(ptr) {}
+
+    ~PixmapInfoBuffer();
+
+    void setFormat(int d, xcb_visualid_t v) { depth = d; visual = v; }
+
     uint8_t* pixmapData(void) override { return buf.data(); }
     const uint8_t* pixmapData(void) const override { return buf.data(); }
     size_t pixmapSize(void) const override { return buf.size(); }
@@ -131,24 +306,54 @@ public:
     const std::vector<uint8_t> & pixels(void) const { return buf; };
 };
 
+class XcbShmPixmap;
+
+/// XcbShmSlot
+struct XcbShmSlot
+{
+    int shmid = -1;
+    uint8_t* addr = nullptr;
+    xcb_shm_seg_t shmseg = XCB_NONE;
+    size_t size = 0;
+    bool memfd = false;
+    bool huge = false;
+    bool busy = false;
+
+    // damage state: region fetched into the slot, areas stale since
+    QRect region;
+    QRegion dirty;
+
+    // region with the areas off all outputs zeroed
+    QRect cleared;
+
+    // server side copy target on the segment
+    xcb_pixmap_t pixmap = XCB_PIXMAP_NONE;
+    QSize pixmapSize;
+    int pixmapDepth = 0;
+};
+
 /// PixmapInfoShm
 class PixmapInfoShm : public XcbPixmapInfo
 {
 protected:
-    uint8_t* buf = nullptr;
+    XcbShmPixmap* owner = nullptr;
+    XcbShmSlot* slot = nullptr;
     uint32_t len = 0;
 
 public:
-    PixmapInfoShm() = default;
+    PixmapInfoShm(XcbShmPixmap* ptr, XcbShmSlot* sl) : owner(ptr), slot(sl) {}
+    ~PixmapInfoShm();
 
-    PixmapInfoShm(int depth, xcb_visualid_t visual, uint8_t* ptr, size_t sz)
-        : XcbPixmapInfo(depth, visual), buf(ptr), len(sz) {}
+    void setFormat(int d, xcb_visualid_t v, size_t sz) { depth = d; visual = v; len = sz; }
+    XcbShmSlot* shmSlot(void) { return slot; }
 
-    uint8_t* pixmapData(void) override { return buf; }
-    const uint8_t* pixmapData(void) const override { return buf; }
+    uint8_t* pixmapData(void) override { return slot->addr; }
+    const uint8_t* pixmapData(void) const override { return slot->addr; }
     size_t pixmapSize(void) const override { return len; }
 };
 
+typedef std::unique_ptr<PixmapInfoShm> PixmapInfoShmReply;
+
 /// XcbComposite
 class XcbComposite
 {
@@ -174,11 +379,20 @@ public:
 class XcbShm
 {
 protected:
+    int versionMajor = 0;
+    int versionMinor = 0;
+    bool sharedPixmaps = false;
 
 public:
     XcbShm(xcb_connection_t* conn);
 
+    // MIT-SHM 1.2: segments passed as file descriptors
+    bool hasAttachFd(void) const { return 1 < versionMajor || (1 == versionMajor && 2 <= versionMinor); }
+    // pixmaps backed by a segment, server optional
+    bool hasSharedPixmaps(void) const { return sharedPixmaps; }
+
     bool attach(xcb_connection_t*, xcb_shm_seg_t, uint32_t shmid, bool readOnly = false) const;
+    bool attachFd(xcb_connection_t*, xcb_shm_seg_t, int fd, bool readOnly = false) const;
     bool detach(xcb_connection_t*, xcb_shm_seg_t) const;
 
     bool putImage(xcb_connection_t*, xcb_drawable_t drawable, xcb_gcontext_t gc, const QSize & total, const QRect & src, const QPoint & dst, uint8_t depth, uint8_t format, uint8_t send_event, xcb_shm_seg_t shmseg, uint32_t offset = 0) const;
@@ -187,39 +401,174 @@ public:
 
 typedef GenericReply<xcb_shm_get_image_reply_t> XcbShmGetImageReply;
 
-/// XcbShPixmap
+/// XcbShmPixmap
 class XcbShmPixmap : protected XcbShm
 {
-    int shmid = -1;
-    uint8_t* addr = nullptr;
-    xcb_shm_seg_t shmseg = XCB_NONE;
+    std::vector<XcbShmSlot> slots;
+    size_t next = 0;
+
+    std::mutex lock;
+    std::condition_variable cond;
+
+    static constexpr size_t pagesz = 4096;
+    static constexpr size_t hugepagesz = 2 * 1024 * 1024;
+
+    // 2MB pages for the segments, cleared if the kernel has none to give
+    bool hugePages = false;
+
+    bool allocSlot(xcb_connection_t*, XcbShmSlot &, size_t);
+    bool allocSlotMemfd(xcb_connection_t*, XcbShmSlot &, size_t, bool huge);
+    bool allocSlotSysV(xcb_connection_t*, XcbShmSlot &, size_t, bool huge);
+    bool resizeSlot(xcb_connection_t*, XcbShmSlot &, size_t);
+    void freeSlot(XcbShmSlot &);
+    void freeSlots(void);
+    void freeSlotPixmap(xcb_connection_t*, XcbShmSlot &) const;
 
 public:
-    XcbShmPixmap(xcb_connection_t* conn, size_t);
+    XcbShmPixmap(xcb_connection_t* conn, size_t count = 3);
     ~XcbShmPixmap();
 
-    XcbShmGetImageReply getImageReply(xcb_connection_t*, xcb_drawable_t drawable, const QRect & reg, uint32_t offset = 0);
+    PixmapInfoShmReply acquire(xcb_connection_t*, size_t);
+    void release(XcbShmSlot*);
+    void markDirty(const QRegion &);
+
+    xcb_shm_get_image_cookie_t requestImage(xcb_connection_t*, XcbShmSlot*, xcb_drawable_t drawable, const QRect & reg, uint32_t offset = 0) const;
+    XcbShmGetImageReply getImageReply(xcb_connection_t*, const xcb_shm_get_image_cookie_t &) const;
+    XcbShmGetImageReply getImageReply(xcb_connection_t*, XcbShmSlot*, xcb_drawable_t drawable, const QRect & reg, uint32_t offset = 0) const;
+
+    void setHugePages(bool);
+    bool hasHugePages(void) const { return hugePages; }
+    static const char* backendName(const XcbShmSlot &);
 
-    XcbPixmapInfoReply getPixmap(const XcbShmGetImageReply &) const;
+    using XcbShm::hasSharedPixmaps;
+    bool slotPixmap(xcb_connection_t*, XcbShmSlot*, xcb_drawable_t, const QSize &, int depth) const;
     bool detach(xcb_connection_t*) const;
 };
 
+/// XcbFramebuffer
+class XcbFramebuffer
+{
+protected:
+    uint8_t* addr = nullptr;
+    size_t size = 0;
+    // pixels after the xwd header and colormap
+    size_t offset = 0;
+    size_t pitch = 0;
+    QSize screenSize;
+    int depth = 0;
+    int bitsPerPixel = 0;
+
+public:
+    XcbFramebuffer(const QString & path);
+    ~XcbFramebuffer();
+
+    XcbFramebuffer(const XcbFramebuffer &) = delete;
+    XcbFramebuffer & operator=(const XcbFramebuffer &) = delete;
+
+    static QString findXvfbScreen(void);
+
+    const QSize & getScreenSize(void) const { return screenSize; }
+    XcbPixmapInfoReply copyRegion(XcbBufferPool*, const QRect &, xcb_visualid_t) const;
+};
+
+/// XcbPendingRegion
+struct XcbPendingRegion
+{
+    xcb_connection_t* conn = nullptr;
+    QRect region;
+    bool full = true;
+    // one get image for the whole region, the format comes with its reply
+    bool single = false;
+
+    // shm requests in flight, or the ready pixmap for the non shm path
+    PixmapInfoShmReply shm;
+    std::list<xcb_shm_get_image_cookie_t> cookies;
+    XcbPixmapInfoReply pixmap;
+
+    // server side copy: copies, then a small reply marks them done
+    std::list<xcb_void_cookie_t> copies;
+    xcb_get_input_focus_cookie_t marker = { 0 };
+
+    // damage since the previous capture of the same region
+    QRegion damage;
+    bool damageKnown = false;
+
+    XcbPendingRegion(xcb_connection_t* ptr, const QRect & reg) : conn(ptr), region(reg) {}
+    ~XcbPendingRegion();
+};
+
+typedef std::unique_ptr<XcbPendingRegion> XcbPendingRegionReply;
+
 typedef GenericReply<xcb_xfixes_get_cursor_image_reply_t> XcbXfixesGetCursorImageReply;
 
 /// XcbXfixes
 class XcbXfixes
 {
 protected:
+    uint8_t firstEvent = 0;
 
 public:
     XcbXfixes(xcb_connection_t* conn);
 
     XcbXfixesGetCursorImageReply getCursorImageReply(xcb_connection_t*) const;
 
+    bool selectCursorInput(xcb_connection_t*, xcb_window_t, uint32_t mask = XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR) const;
+    const xcb_xfixes_cursor_notify_event_t* toCursorNotify(const xcb_generic_event_t*) const;
+
     uint32_t* getCursorImageData(const XcbXfixesGetCursorImageReply &) const;
     size_t getCursorImageLength(const XcbXfixesGetCursorImageReply &) const;
 };
 
+/// XcbDamage
+class XcbDamage
+{
+protected:
+    uint8_t firstEvent = 0;
+
+public:
+    XcbDamage(xcb_connection_t* conn);
+
+    xcb_damage_damage_t create(xcb_connection_t*, xcb_drawable_t, uint8_t level = XCB_DAMAGE_REPORT_LEVEL_BOUNDING_BOX) const;
+    bool destroy(xcb_connection_t*, xcb_damage_damage_t) const;
+    void subtract(xcb_connection_t*, xcb_damage_damage_t) const;
+
+    const xcb_damage_notify_event_t* toDamageNotify(const xcb_generic_event_t*) const;
+};
+
+/// XcbOutputInfo
+struct XcbOutputInfo
+{
+    QString name;
+    QRect geometry;
+};
+
+/// XcbRandr
+class XcbRandr
+{
+protected:
+    uint8_t firstEvent = 0;
+
+public:
+    XcbRandr(xcb_connection_t* conn);
+
+    bool selectScreenChange(xcb_connection_t*, xcb_window_t) const;
+    QList<XcbOutputInfo> getOutputList(xcb_connection_t*, xcb_window_t) const;
+    const xcb_randr_screen_change_notify_event_t* toScreenChangeNotify(const xcb_generic_event_t*) const;
+};
+
+/// XcbPresent
+class XcbPresent
+{
+protected:
+    uint8_t majorOpcode = 0;
+
+public:
+    XcbPresent(xcb_connection_t* conn);
+
+    bool selectInput(xcb_connection_t*, uint32_t eid, xcb_window_t, uint32_t mask = XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY) const;
+    const xcb_present_complete_notify_event_t* toCompleteNotify(const xcb_generic_event_t*) const;
+};
+
 struct WinFrameSize
 {
     uint32_t left = 0;
@@ -228,6 +577,57 @@ struct WinFrameSize
     uint32_t bottom = 0;
 };
 
+/// XcbCursorImage
+struct XcbCursorImage
+{
+    uint32_t serial = 0;
+    QSize size;
+    QPoint hotspot;
+    // argb, premultiplied
+    std::vector<uint32_t> pixels;
+};
+
+/// XcbWindowInfo
+struct XcbWindowInfo
+{
+    xcb_window_t win = XCB_WINDOW_NONE;
+    xcb_window_t parent = XCB_WINDOW_NONE;
+    QStringList wmClass;
+    QString name;
+};
+
+/// XcbWindowState
+struct XcbWindowState
+{
+    xcb_window_t win = XCB_WINDOW_NONE;
+    // structure notify selected up to the root
+    std::vector<xcb_window_t> parents;
+
+    QSize size;
+    QPoint position;
+    WinFrameSize frame;
+    xcb_window_t active = XCB_WINDOW_NONE;
+    bool alive = false;
+    bool mapped = true;
+
+    // refetch on the next processEvents
+    bool positionDirty = false;
+    bool parentsDirty = false;
+    bool frameDirty = false;
+    bool activeDirty = false;
+    bool aliveDirty = false;
+};
+
+/// XcbFrameStats
+struct XcbFrameStats
+{
+    // requests counted at the call sites
+    uint32_t requests = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t bytesRead = 0;
+    XcbCallStats calls;
+};
+
 /// XcbConnection
 struct XcbConnection
 {
@@ -237,10 +637,85 @@ protected:
     std::unique_ptr<XcbXfixes> xfixes;
     std::unique_ptr<XcbShmPixmap> shmpix;
     std::unique_ptr<XcbComposite> composite;
+    std::unique_ptr<XcbDamage> damage;
+    std::unique_ptr<XcbRandr> randr;
+    std::unique_ptr<XcbPresent> present;
+
+    // frame buffers of the non shm path
+    mutable XcbBufferPool bufpool;
+
+    // xvfb -fbdir screen, mapped at the first framebuffer start
+    std::unique_ptr<XcbFramebuffer> fbmap;
+    bool fbLookup = false;
+    bool fbCapture = false;
 
     xcb_screen_t* screen;
     xcb_format_t* format;
 
+    // updated from randr screen change events
+    QSize rootSize;
+    QRegion outputsRegion;
+    bool outputsDirty = true;
+
+    // interned atoms, shared by the gui and capture users
+    mutable std::mutex atomLock;
+    mutable QHash<QString, xcb_atom_t> atoms;
+
+    void internAtoms(const QStringList &);
+
+    // damage tracking, used from the capture thread only
+    xcb_damage_damage_t damageId = XCB_NONE;
+    QRegion damageRegion;
+    QRect damageLastRegion;
+    int damageDepth = 0;
+    xcb_visualid_t damageVisual = 0;
+    size_t damagePitch = 0;
+
+    // server side copy into shm pixmaps
+    xcb_gcontext_t copyGC = XCB_NONE;
+    int copyDepth = 0;
+    xcb_visualid_t copyVisual = 0;
+
+    // window state from events, used from the capture thread only
+    XcbWindowState watch;
+    xcb_atom_t atomActiveWindow = XCB_ATOM_NONE;
+    xcb_atom_t atomClientList = XCB_ATOM_NONE;
+    xcb_atom_t atomFrameExtents = XCB_ATOM_NONE;
+
+    void watchParents(void);
+    void watchRefresh(void);
+
+    void takeDamage(XcbPendingRegion*) const;
+
+    // composite pixmap of the captured window, renamed after resize or remap
+    xcb_window_t compositeWin = XCB_WINDOW_NONE;
+    xcb_pixmap_t compositePix = XCB_PIXMAP_NONE;
+    bool compositeRedirected = false;
+    bool compositeDirty = false;
+
+    void compositeRebind(void);
+
+    // frame sync: present complete or damage since the last capture
+    std::vector<std::pair<uint32_t, xcb_window_t>> syncEvents;
+    xcb_damage_damage_t syncDamageId = XCB_NONE;
+    bool syncPresented = false;
+    bool syncReady = false;
+
+    void processEvent(GenericEvent &);
+
+    // cursor image, refetched on xfixes cursor notify only
+    XcbCursorImage cursorImage;
+    bool cursorTracking = false;
+    bool cursorDirty = true;
+
+    // request and reply counters of the capture thread
+    XcbRequestStats stats;
+    // counters at the last take
+    unsigned int statsSequence = 0;
+    uint64_t statsWritten = 0;
+    uint64_t statsRead = 0;
+    XcbCallStats statsCalls;
+
 public:
     XcbConnection();
     virtual ~XcbConnection();
@@ -259,8 +734,11 @@ public:
     xcb_window_t getWindowParent(xcb_window_t) const;
     xcb_window_t getActiveWindow(void) const;
     xcb_window_t getScreenRoot(void) const;
+    QSize getScreenSize(void) const;
+    QList<XcbOutputInfo> getOutputList(void) const;
     //xcb_screen_t* getScreen(void) const;
     QList<xcb_window_t> getWindowList(void) const;
+    QList<XcbWindowInfo> getWindowInfoList(void) const;
     WinFrameSize getWindowFrame(xcb_window_t) const;
     QString getAtomName(xcb_atom_t) const;
 
@@ -269,9 +747,16 @@ public:
     const XcbXfixes* getXfixesExtension(void) const { return xfixes.get(); }
     const XcbShmPixmap* getShmExtension(void) const { return shmpix.get(); }
     const XcbComposite* getCompositeExtension(void) const { return composite.get(); }
+    const XcbDamage* getDamageExtension(void) const { return damage.get(); }
+    const XcbRandr* getRandrExtension(void) const { return randr.get(); }
+    const XcbPresent* getPresentExtension(void) const { return present.get(); }
 
     int bppFromDepth(int depth) const;
     int depthFromBPP(int bitsPerPixel) const;
+    size_t pixmapLength(const QSize &) const;
+    size_t pixmapPitch(int width, int depth) const;
+    xcb_visualid_t findVisualId(int depth) const;
+    ColorConvert::PixelLayout pixelLayout(int depth, xcb_visualid_t) const;
 
     XcbPropertyReply getPropertyAnyType(xcb_window_t win, xcb_atom_t prop, uint32_t offset = 0, uint32_t length = 0xFFFFFFFF) const;
     xcb_atom_t getPropertyType(xcb_window_t win, xcb_atom_t prop) const;
@@ -280,13 +765,53 @@ public:
 
     XcbPixmapInfoReply getWindowRegion(xcb_window_t, const QRect &, QString* errstr = nullptr) const;
 
-    template<typename Reply, typename Cookie>
-    ReplyError<Reply> getReply2(std::function<Reply*(xcb_connection_t*, Cookie, xcb_generic_error_t**)> func, Cookie cookie) const
-    {
-        return getReply1<Reply, Cookie>(func, conn.get(), cookie);
-    }
-
-#define getReplyFunc2(NAME,conn,...) getReply2<NAME##_reply_t,NAME##_cookie_t>(NAME##_reply,NAME(conn,##__VA_ARGS__))
+    void processEvents(void);
+    bool waitEvents(int ms);
+
+    bool damageStart(xcb_drawable_t);
+    void damageStop(void);
+    void damageAdd(const QRect &);
+    bool damagePending(const QRect &);
+
+    bool copyAreaStart(xcb_drawable_t);
+    void copyAreaStop(void);
+
+    void setHugePages(bool);
+
+    bool watchStart(xcb_window_t);
+    void watchStop(void);
+    const XcbWindowState & windowState(void) const { return watch; }
+
+    bool compositeStart(xcb_window_t);
+    void compositeStop(void);
+    // the composite pixmap, or the watched window without one
+    xcb_drawable_t captureDrawable(void) const { return compositePix != XCB_PIXMAP_NONE ? compositePix : watch.win; }
+    // unmapped, or redirected without a named pixmap: get image and copy area fail with BadMatch
+    bool captureReady(void) const { return watch.mapped && (compositeWin == XCB_WINDOW_NONE || compositePix != XCB_PIXMAP_NONE); }
+
+    bool framebufferStart(void);
+    void framebufferStop(void);
+    // null before the first framebuffer start
+    const XcbFramebuffer* getFramebuffer(void) const { return fbmap.get(); }
+
+    bool frameSyncStart(xcb_window_t);
+    void frameSyncStop(void);
+    bool frameSyncTake(void);
+
+    bool cursorStart(void);
+    void cursorStop(void);
+    const XcbCursorImage* getCursorImage(void);
+    QPoint getPointerPosition(void) const;
+
+    void statsStart(void);
+    void statsStop(void);
+    XcbFrameStats statsTake(void);
+    uint32_t statsSent(void);
+    void statsReset(void);
+    const XcbRequestStats & requestStats(void) const { return stats; }
+
+    XcbPendingRegionReply requestWindowRegion(xcb_drawable_t, const QRect &, QString* errstr = nullptr);
+    XcbPixmapInfoReply completeWindowRegion(XcbPendingRegionReply, QString* errstr = nullptr);
 };
 
 #endif // XCB_WRAPPER_H